@@ -15,14 +15,25 @@
  */
 
 #define _GNU_SOURCE
+#include <dirent.h>
+#include <endian.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
 #include <stdarg.h>
 #include <stdbool.h>
 #include <stdio.h>
 #include <stdint.h>
+#include <stdlib.h>
 #include <string.h>
 #include <sys/types.h>
 #include <syslog.h>
 #include <time.h>
+#include <unistd.h>
+
+#if defined(__ARM_FEATURE_CRC32)
+#include <arm_acle.h>
+#endif
 
 #include "common.h"
 
@@ -68,40 +79,236 @@ void put_u32(uint8_t *ptr, uint32_t val)
 	memcpy(ptr, &val, sizeof(val));
 }
 
+uint64_t mbox_clock_ns(void)
+{
+	struct timespec time;
+
+	clock_gettime(CLOCK_MONOTONIC, &time);
+
+	return time.tv_sec * 1000000000ULL + time.tv_nsec;
+}
+
+/* The primes of xxHash64 */
+#define HASH_P1 0x9e3779b185ebca87ULL
+#define HASH_P2 0xc2b2ae3d27d4eb4fULL
+#define HASH_P3 0x165667b19e3779f9ULL
+#define HASH_P4 0x85ebca77c2b2ae63ULL
+
+static uint64_t rotl64(uint64_t x, int r)
+{
+	return (x << r) | (x >> (64 - r));
+}
+
+/*
+ * xxHash64's round a word at a time, with its final avalanche. The rotate
+ * in each round carries the high bits of every word down into the low bits
+ * of the next, so small edits anywhere in an erase block change the hash.
+ * It isn't meant to stand up to anyone trying to fool it.
+ */
+uint64_t mbox_hash(const void *buf, size_t len)
+{
+	const uint8_t *p = buf;
+	uint64_t hash = HASH_P3 + len;
+	uint64_t word;
+
+	for (; len >= sizeof(word); len -= sizeof(word), p += sizeof(word)) {
+		memcpy(&word, p, sizeof(word));
+		hash ^= rotl64(word * HASH_P2, 31) * HASH_P1;
+		hash = rotl64(hash, 27) * HASH_P1 + HASH_P4;
+	}
+	for (; len; len--, p++) {
+		hash ^= *p * HASH_P3;
+		hash = rotl64(hash, 11) * HASH_P1;
+	}
+
+	hash ^= hash >> 33;
+	hash *= HASH_P2;
+	hash ^= hash >> 29;
+	hash *= HASH_P3;
+	hash ^= hash >> 32;
+
+	return hash;
+}
+
+/* Castagnoli, reflected */
+#define CRC32C_POLY 0x82f63b78
+
+#if !defined(__SSE4_2__) && !defined(__ARM_FEATURE_CRC32)
+/* Slicing by 8, without the instructions for it */
+static uint32_t crc32c_table[8][256];
+
+static void crc32c_init(void)
+{
+	uint32_t crc;
+	int i, j;
+
+	for (i = 0; i < 256; i++) {
+		crc = i;
+		for (j = 0; j < 8; j++)
+			crc = crc & 1 ? (crc >> 1) ^ CRC32C_POLY : crc >> 1;
+		crc32c_table[0][i] = crc;
+	}
+	for (i = 0; i < 256; i++) {
+		crc = crc32c_table[0][i];
+		for (j = 1; j < 8; j++) {
+			crc = crc32c_table[0][crc & 0xff] ^ (crc >> 8);
+			crc32c_table[j][i] = crc;
+		}
+	}
+}
+#endif
+
+/*
+ * CRC32C of 'buf' continuing from 'crc', 0 to start. With the CPU's CRC32C
+ * instructions where the build allows them.
+ */
+uint32_t mbox_crc32c(uint32_t crc, const void *buf, size_t len)
+{
+	const uint8_t *p = buf;
+	uint64_t word;
+
+	crc = ~crc;
+#if defined(__SSE4_2__)
+	for (; len >= sizeof(word); len -= sizeof(word), p += sizeof(word)) {
+		memcpy(&word, p, sizeof(word));
+		crc = __builtin_ia32_crc32di(crc, word);
+	}
+	for (; len; len--)
+		crc = __builtin_ia32_crc32qi(crc, *p++);
+#elif defined(__ARM_FEATURE_CRC32)
+	for (; len >= sizeof(word); len -= sizeof(word), p += sizeof(word)) {
+		memcpy(&word, p, sizeof(word));
+		crc = __crc32cd(crc, word);
+	}
+	for (; len; len--)
+		crc = __crc32cb(crc, *p++);
+#else
+	if (!crc32c_table[0][1])
+		crc32c_init();
+	for (; len >= sizeof(word); len -= sizeof(word), p += sizeof(word)) {
+		memcpy(&word, p, sizeof(word));
+		word = le64toh(word) ^ crc;
+		crc = crc32c_table[7][word & 0xff] ^
+			crc32c_table[6][(word >> 8) & 0xff] ^
+			crc32c_table[5][(word >> 16) & 0xff] ^
+			crc32c_table[4][(word >> 24) & 0xff] ^
+			crc32c_table[3][(word >> 32) & 0xff] ^
+			crc32c_table[2][(word >> 40) & 0xff] ^
+			crc32c_table[1][(word >> 48) & 0xff] ^
+			crc32c_table[0][word >> 56];
+	}
+	for (; len; len--)
+		crc = crc32c_table[0][(crc ^ *p++) & 0xff] ^ (crc >> 8);
+#endif
+
+	return ~crc;
+}
 
-static bool is_pnor_part(const char *str)
+static int sysfs_read(const char *dir, const char *attr, char *buf,
+		size_t len)
 {
-	return strcasestr(str, "pnor") != NULL;
+	char path[PATH_MAX];
+	ssize_t n;
+	int fd;
+
+	snprintf(path, sizeof(path), "%s/%s/%s", MTD_SYSFS, dir, attr);
+	fd = open(path, O_RDONLY | O_CLOEXEC);
+	if (fd < 0)
+		return -errno;
+	n = read(fd, buf, len - 1);
+	close(fd);
+	if (n < 0)
+		return -errno;
+
+	buf[n] = '\0';
+	buf[strcspn(buf, "\n")] = '\0';
+
+	return 0;
 }
 
-char *get_dev_mtd(void)
+static int mtd_cmp(const void *a, const void *b)
 {
-	FILE *f;
-	char *ret = NULL, *pos = NULL;
-	char line[255];
-
-	f = fopen("/proc/mtd", "r");
-	if (!f)
-		return NULL;
-
-	while (!pos && fgets(line, sizeof(line), f) != NULL) {
-		/* Going to have issues if we didn't get the full line */
-		if (line[strlen(line) - 1] != '\n')
-			break;
-
-		if (is_pnor_part(line)) {
-			pos = strchr(line, ':');
-			if (!pos)
-				break;
+	const struct mtd_dev *x = a, *y = b;
+
+	return (x->index > y->index) - (x->index < y->index);
+}
+
+/*
+ * Every MTD with its name and geometry, in one pass over sysfs, in device
+ * order. Returns how many, or a negative errno.
+ */
+int mtd_discover(struct mtd_dev **devs)
+{
+	struct mtd_dev *dev, *more;
+	struct dirent *entry;
+	char buf[32], *end;
+	unsigned int index;
+	int n = 0;
+	DIR *dir;
+
+	*devs = NULL;
+	dir = opendir(MTD_SYSFS);
+	if (!dir)
+		return -errno;
+
+	while ((entry = readdir(dir))) {
+		/* mtdN only, not the mtdNro read only aliases */
+		if (strncmp(entry->d_name, "mtd", 3))
+			continue;
+		index = strtoul(entry->d_name + 3, &end, 10);
+		if (end == entry->d_name + 3 || *end)
+			continue;
+
+		more = realloc(*devs, (n + 1) * sizeof(**devs));
+		if (!more) {
+			closedir(dir);
+			free(*devs);
+			*devs = NULL;
+			return -ENOMEM;
 		}
+		*devs = more;
+		dev = &(*devs)[n];
+		memset(dev, 0, sizeof(*dev));
+		dev->index = index;
+		if (sysfs_read(entry->d_name, "name", dev->name,
+					sizeof(dev->name)))
+			continue;
+		if (!sysfs_read(entry->d_name, "size", buf, sizeof(buf)))
+			dev->size = strtoul(buf, NULL, 0);
+		if (!sysfs_read(entry->d_name, "erasesize", buf, sizeof(buf)))
+			dev->erasesize = strtoul(buf, NULL, 0);
+		n++;
 	}
-	fclose(f);
+	closedir(dir);
+
+	qsort(*devs, n, sizeof(**devs), mtd_cmp);
+
+	return n;
+}
+
+/*
+ * The /dev node of the MTD called 'name', or without one the first whose
+ * name has "pnor" in it. Only MTDs made of whole erase blocks can be served.
+ */
+char *get_dev_mtd(const char *name)
+{
+	struct mtd_dev *devs;
+	char *ret = NULL;
+	int i, n;
 
-	if (pos) {
-		*pos = '\0';
-		if (asprintf(&ret, "/dev/%s", line) == -1)
+	n = mtd_discover(&devs);
+	for (i = 0; i < n; i++) {
+		if (name ? strcmp(devs[i].name, name) :
+				!strcasestr(devs[i].name, "pnor"))
+			continue;
+		if (!devs[i].size || !devs[i].erasesize ||
+				devs[i].size % devs[i].erasesize)
+			continue;
+		if (asprintf(&ret, "/dev/mtd%u", devs[i].index) == -1)
 			ret = NULL;
+		break;
 	}
+	free(devs);
 
 	return ret;
 }
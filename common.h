@@ -14,6 +14,9 @@
  *
  */
 
+#ifndef COMMON_H
+#define COMMON_H
+
 #ifndef PREFIX
 #define PREFIX ""
 #endif
@@ -39,4 +42,25 @@ uint32_t get_u32(uint8_t *ptr);
 
 void put_u32(uint8_t *ptr, uint32_t val);
 
-char *get_dev_mtd(void);
+uint64_t mbox_clock_ns(void);
+
+uint64_t mbox_hash(const void *buf, size_t len);
+
+uint32_t mbox_crc32c(uint32_t crc, const void *buf, size_t len);
+
+#ifndef MTD_SYSFS
+#define MTD_SYSFS "/sys/class/mtd"
+#endif
+
+struct mtd_dev {
+	unsigned int index;
+	char name[64];
+	uint32_t size;
+	uint32_t erasesize;
+};
+
+int mtd_discover(struct mtd_dev **devs);
+
+char *get_dev_mtd(const char *name);
+
+#endif /* COMMON_H */
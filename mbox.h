@@ -14,6 +14,11 @@
  *
  */
 
+#ifndef MBOX_H
+#define MBOX_H
+
+#include <stdint.h>
+
 #define MBOX_C_RESET_STATE 0x01
 #define MBOX_C_GET_MBOX_INFO 0x02
 #define MBOX_C_GET_FLASH_INFO 0x03
@@ -24,12 +29,40 @@
 #define MBOX_C_WRITE_FENCE 0x08
 #define MBOX_C_ACK 0x09
 #define MBOX_C_COMPLETED_COMMANDS 0x0a
+#define MBOX_C_WRITE_DIRTY_LIST 0x0b
 
 #define MBOX_R_SUCCESS 0x01
 #define MBOX_R_PARAM_ERROR 0x02
 #define MBOX_R_WRITE_ERROR 0x03
 #define MBOX_R_SYSTEM_ERROR 0x4
 #define MBOX_R_TIMEOUT 0x05
+#define MBOX_R_BUSY 0x06
+
+#define MBOX_API_VERSION_1 1
+#define MBOX_API_VERSION_2 2
+
+/* Bits in the BMC status byte */
+#define MBOX_BMC_EVT_REBOOT 0x01
+#define MBOX_BMC_EVT_COMPLETE 0x02
+#define MBOX_BMC_EVT_FLASH_BUSY 0x04
+#define MBOX_BMC_EVT_CACHE_READY 0x08
+#define MBOX_BMC_EVT_SUSPENDED 0x10
+
+/* Capabilities negotiated through GET_MBOX_INFO, version 2 onwards */
+#define MBOX_CAP_SPLIT_WINDOWS 0x01
+#define MBOX_CAP_BLOCK_SIZE 0x02
+#define MBOX_CAP_MULTI_WINDOW 0x04
+#define MBOX_CAP_ASYNC 0x08
+#define MBOX_CAP_DIRTY_LIST 0x10
+
+/* Entries in a WRITE_DIRTY_LIST, each a u16 block offset and u16 count */
+#define MBOX_DIRTY_LIST_ENTRY_BYTES 4
+#define MBOX_DIRTY_LIST_MAX 256
+
+/* Block size shift, version 1 hosts always use 4K blocks */
+#define MBOX_BLOCK_SHIFT_DEFAULT 12
+#define MBOX_BLOCK_SHIFT_MIN 12
+#define MBOX_BLOCK_SHIFT_MAX 16
 
 #define MBOX_HOST_PATH "/dev/aspeed-mbox"
 #define MBOX_HOST_TIMEOUT_SEC 1
@@ -50,4 +83,4 @@ union mbox_regs {
 	struct mbox_msg msg;
 };
 
-
+#endif /* MBOX_H */
@@ -25,6 +25,7 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <strings.h>
 #include <syslog.h>
 #include <signal.h>
 #include <sys/ioctl.h>
@@ -42,38 +43,22 @@
 
 #include "mbox.h"
 #include "common.h"
+#include "mboxd.h"
+#include "mboxd_ctrl.h"
+#include "mboxd_ecc.h"
+#include "mboxd_flash.h"
+#include "mboxd_notify.h"
+#include "mboxd_regs.h"
+#include "mboxd_scan.h"
+#include "mboxd_sched.h"
+#include "mboxd_txn.h"
+#include "mboxd_wear.h"
 
 #define LPC_CTRL_PATH "/dev/aspeed-lpc-ctrl"
 
-
-/* Put pulled fds first */
-#define MBOX_FD 0
-#define POLL_FDS 1
-#define LPC_CTRL_FD 1
-#define MTD_FD 2
-#define TOTAL_FDS 3
-
-#define ALIGN_UP(_v, _a)    (((_v) + (_a) - 1) & ~((_a) - 1))
-
-#define MSG_OUT(f_, ...) do { if (verbosity != MBOX_LOG_NONE) { mbox_log(LOG_INFO, f_, ##__VA_ARGS__); } } while(0)
-#define MSG_ERR(f_, ...) do { if (verbosity != MBOX_LOG_NONE) { mbox_log(LOG_ERR, f_, ##__VA_ARGS__); } } while(0)
-
 #define BOOT_HICR7 0x30000e00U
 #define BOOT_HICR8 0xfe0001ffU
 
-struct mbox_context {
-	struct pollfd fds[TOTAL_FDS];
-	void *lpc_mem;
-	uint32_t base;
-	uint32_t size;
-	uint32_t pgsize;
-	bool dirty;
-	uint32_t dirtybase;
-	uint32_t dirtysize;
-	struct mtd_info_user mtd_info;
-	uint32_t flash_size;
-};
-
 static int running = 1;
 static int sighup = 0;
 
@@ -117,39 +102,237 @@ static int point_to_flash(struct mbox_context *context)
 	return r;
 }
 
-static int flash_write(struct mbox_context *context, uint32_t pos, uint32_t len)
+/*
+ * Make sure the window is valid before the host is pointed at it. Usually
+ * the prefetch queued by CLOSE_WINDOW has done most of the work already, if
+ * not whatever is left now has the host waiting on it. If the last fill
+ * failed part way the whole window is read again, and the host gets the
+ * error should that fail too.
+ */
+static int window_fill(struct mbox_context *context, uint8_t seq,
+		uint64_t arrived)
 {
-	int rc;
-	struct erase_info_user erase_info = {
-		.start = pos,
-	};
+	struct mbox_work *work = context->prefetch;
+
+	if (!context->dirty && !context->fill_failed)
+		return MBOX_R_SUCCESS;
+
+	context->dirty = false;
+	if (!work && context->fill_failed) {
+		work = sched_submit(context, MBOX_SCHED_DEMAND, seq, arrived,
+				0, context->size);
+		if (!work)
+			return MBOX_R_SYSTEM_ERROR;
+		work->fill = true;
+		return sched_wait(context, work,
+				context->caps & MBOX_CAP_ASYNC);
+	}
+	if (!work)
+		return MBOX_R_SUCCESS;
 
-	assert(context);
+	context->prefetch = NULL;
+	sched_promote(context, work, MBOX_SCHED_DEMAND, seq, arrived);
+
+	return sched_wait(context, work, context->caps & MBOX_CAP_ASYNC);
+}
 
-	erase_info.length = ALIGN_UP(len, context->mtd_info.erasesize);
+/* Capabilities this daemon can offer a version 2 host */
+#define MBOX_CAPS_SUPPORTED (MBOX_CAP_SPLIT_WINDOWS | MBOX_CAP_BLOCK_SIZE | \
+		MBOX_CAP_ASYNC | MBOX_CAP_DIRTY_LIST)
 
-	MSG_OUT("Erasing 0x%08x for 0x%08x (aligned: 0x%08x)\n", pos, len, erase_info.length);
-	if (ioctl(context->fds[MTD_FD].fd, MEMERASE, &erase_info) == -1) {
-		MSG_ERR("Couldn't MEMERASE ioctl, flash write lost: %s\n", strerror(errno));
-		return -1;
+static bool block_shift_valid(struct mbox_context *context, uint8_t shift)
+{
+	uint32_t block = 1U << shift;
+
+	if (shift < MBOX_BLOCK_SHIFT_MIN || shift > MBOX_BLOCK_SHIFT_MAX)
+		return false;
+
+	/* Windows and offsets have to be whole blocks */
+	if (context->size & (block - 1) || context->write_size & (block - 1))
+		return false;
+
+	/* Window sizes and offsets are 16 bit block counts */
+	if ((context->size >> shift) > UINT16_MAX ||
+			(context->flash->mtd_info.size >> shift) > UINT16_MAX)
+		return false;
+
+	return true;
+}
+
+/*
+ * Pick the block size for a host that can negotiate it. Blocks match the
+ * erase size if possible so that dirty tracking doesn't end up erasing more
+ * than the host asked for. A host that asks for something specific gets the
+ * largest valid block size no bigger than what it asked for.
+ */
+static uint8_t block_shift(struct mbox_context *context, uint8_t requested)
+{
+	uint8_t shift;
+
+	if (!requested) {
+		requested = ffs(context->flash->mtd_info.erasesize) - 1;
+		if (requested > MBOX_BLOCK_SHIFT_MAX)
+			requested = MBOX_BLOCK_SHIFT_MAX;
 	}
 
-	if (lseek(context->fds[MTD_FD].fd, pos, SEEK_SET) == (off_t) -1) {
-		MSG_ERR("Couldn't seek to 0x%08x into MTD, flash write lost: %s\n", pos, strerror(errno));
-		return -1;
+	for (shift = requested; shift > MBOX_BLOCK_SHIFT_MIN; shift--) {
+		if (block_shift_valid(context, shift))
+			return shift;
 	}
 
-	while (erase_info.length) {
-		rc = write(context->fds[MTD_FD].fd, context->lpc_mem + pos, erase_info.length);
-		if (rc == -1) {
-			MSG_ERR("Couldn't write to flash! Flash write lost: %s\n", strerror(errno));
-			return -1;
+	return MBOX_BLOCK_SHIFT_DEFAULT;
+}
+
+/*
+ * Version 1 hosts get exactly what they always had. Later hosts tell us
+ * which capabilities they understand and get back the ones we also do.
+ */
+static int mbox_info(struct mbox_context *context, union mbox_regs *req,
+		union mbox_regs *resp)
+{
+	uint8_t version = req->msg.data[0];
+
+	/* Hosts from before versioning leave it zero, they speak version 1 */
+	if (version == 0)
+		version = MBOX_API_VERSION_1;
+
+	context->api_version = version < MBOX_API_VERSION_2 ? version
+		: MBOX_API_VERSION_2;
+	context->caps = 0;
+	if (context->api_version >= MBOX_API_VERSION_2)
+		context->caps = req->msg.data[1] & MBOX_CAPS_SUPPORTED;
+
+	context->pgsize = MBOX_BLOCK_SHIFT_DEFAULT;
+	if (context->caps & MBOX_CAP_BLOCK_SIZE)
+		context->pgsize = block_shift(context, req->msg.data[2]);
+
+	MSG_OUT("Using API version %d, capabilities 0x%02x, %uK blocks\n",
+			context->api_version, context->caps,
+			(1U << context->pgsize) >> 10);
+
+	resp->msg.data[0] = context->api_version;
+	put_u16(&resp->msg.data[1], context->size >> context->pgsize);
+	if (context->caps & MBOX_CAP_SPLIT_WINDOWS)
+		put_u16(&resp->msg.data[3], context->write_size >> context->pgsize);
+	else
+		put_u16(&resp->msg.data[3], context->size >> context->pgsize);
+
+	if (context->api_version >= MBOX_API_VERSION_2) {
+		resp->msg.data[5] = context->pgsize;
+		resp->msg.data[6] = context->caps;
+		resp->msg.data[7] = 1; /* Number of windows */
+	}
+
+	return MBOX_R_SUCCESS;
+}
+
+/*
+ * Where dirty data starts in flash. Version 1 hosts use offsets from the
+ * start of the region, later ones offsets within the write window.
+ */
+static int dirty_range(struct mbox_context *context, uint16_t dirtypg,
+		uint32_t dirtycount, uint32_t *pos)
+{
+	uint32_t start = 0, size = context->size;
+
+	if (context->api_version >= MBOX_API_VERSION_2) {
+		start = context->dirtybase - context->base;
+		size = context->write_size;
+		if (start >= context->size)
+			return MBOX_R_PARAM_ERROR;
+		if (size > context->size - start)
+			size = context->size - start;
+	}
+
+	*pos = (uint32_t)dirtypg << context->pgsize;
+	if (dirtycount == 0 || *pos >= size || dirtycount > size - *pos)
+		return MBOX_R_PARAM_ERROR;
+
+	*pos += start;
+
+	return MBOX_R_SUCCESS;
+}
+
+/*
+ * The host has written a list of dirty ranges into the write window, merge
+ * them all into a single flush. The list itself isn't flash contents so
+ * the blocks it sits in are reloaded from flash once it has been read,
+ * which is why it can't share a block with anything the host dirtied.
+ */
+static int dirty_list(struct mbox_context *context, union mbox_regs *req,
+		uint64_t arrived)
+{
+	uint8_t list[MBOX_DIRTY_LIST_MAX * MBOX_DIRTY_LIST_ENTRY_BYTES];
+	uint16_t n = get_u16(&req->msg.data[2]);
+	struct mbox_range ranges[MBOX_DIRTY_LIST_MAX];
+	uint32_t listpos, listlen, block = 1U << context->pgsize;
+	struct mbox_work *work;
+	int i, resp;
+
+	if (n == 0 || n > MBOX_DIRTY_LIST_MAX)
+		return MBOX_R_PARAM_ERROR;
+
+	listlen = n * MBOX_DIRTY_LIST_ENTRY_BYTES;
+	resp = dirty_range(context, get_u16(&req->msg.data[0]), listlen,
+			&listpos);
+	if (resp != MBOX_R_SUCCESS)
+		return resp;
+
+	memcpy(list, context->lpc_mem + listpos, listlen);
+	for (i = 0; i < n; i++) {
+		uint8_t *entry = &list[i * MBOX_DIRTY_LIST_ENTRY_BYTES];
+
+		resp = dirty_range(context, get_u16(&entry[0]),
+				(uint32_t)get_u16(&entry[2]) << context->pgsize,
+				&ranges[i].pos);
+		if (resp != MBOX_R_SUCCESS)
+			return resp;
+		ranges[i].len = (uint32_t)get_u16(&entry[2]) << context->pgsize;
+
+		if (ranges[i].pos < ALIGN_UP(listpos + listlen, block) &&
+				(listpos & ~(block - 1)) < ranges[i].pos + ranges[i].len) {
+			MSG_ERR("Dirty list overlaps dirty range %d\n", i);
+			return MBOX_R_PARAM_ERROR;
 		}
-		erase_info.length -= rc;
-		pos += rc;
 	}
 
-	return 0;
+	listlen = ALIGN_UP(listpos + listlen, block) - (listpos & ~(block - 1));
+	listpos &= ~(block - 1);
+	if (sched_flush_pending(context, listpos, listlen)) {
+		MSG_ERR("Dirty list overlaps an outstanding flush\n");
+		return MBOX_R_PARAM_ERROR;
+	}
+	if (flash_read(context, listpos, listlen))
+		return MBOX_R_SYSTEM_ERROR;
+
+	if (context->txn) {
+		for (i = 0; i < n; i++)
+			txn_stage(context, ranges[i].pos, ranges[i].len);
+		return MBOX_R_SUCCESS;
+	}
+
+	MSG_OUT("Flushing %d dirty ranges\n", n);
+	work = sched_submit_ranges(context, MBOX_SCHED_FLUSH, req->msg.seq,
+			arrived, ranges, n);
+	if (!work)
+		return MBOX_R_SYSTEM_ERROR;
+
+	return sched_wait(context, work, context->caps & MBOX_CAP_ASYNC);
+}
+
+/* Commands that can't be answered without touching the flash */
+static bool needs_flash(uint8_t command)
+{
+	switch (command) {
+		case MBOX_C_READ_WINDOW:
+		case MBOX_C_WRITE_WINDOW:
+		case MBOX_C_WRITE_DIRTY:
+		case MBOX_C_WRITE_FENCE:
+		case MBOX_C_WRITE_DIRTY_LIST:
+			return true;
+		default:
+			return false;
+	}
 }
 
 /* TODO: Add come consistency around the daemon exiting and either
@@ -160,14 +343,14 @@ static int flash_write(struct mbox_context *context, uint32_t pos, uint32_t len)
  */
 static int dispatch_mbox(struct mbox_context *context)
 {
-	int r = 0;
-	int len;
-	off_t pos;
-	uint8_t byte;
+	int r = 0, rc;
+	bool set_bmc = false;
 	union mbox_regs resp, req = { 0 };
-	uint16_t sizepg, basepg, dirtypg;
-	uint32_t dirtycount;
+	uint16_t basepg, dirtypg;
+	uint32_t dirtycount, dirtypos;
 	struct aspeed_lpc_ctrl_mapping map;
+	struct mbox_work *work;
+	uint64_t arrived;
 
 	assert(context);
 
@@ -178,27 +361,33 @@ static int dispatch_mbox(struct mbox_context *context)
 	map.window_id = 0; /* Theres only one */
 
 	MSG_OUT("Dispatched to mbox\n");
-	r = read(context->fds[MBOX_FD].fd, &req, sizeof(req.raw));
-	if (r < 0) {
-		r = -errno;
-		MSG_ERR("Couldn't read: %s\n", strerror(errno));
+	arrived = mbox_clock_ns();
+	context->last_command = arrived;
+	mbox_regs_begin(context);
+	r = mbox_regs_read(context, &req);
+	if (r < 0)
 		goto out;
-	}
-	if (r < sizeof(req.msg)) {
-		MSG_ERR("Short read: %d expecting %zu\n", r, sizeof(req.msg));
-		r = -1;
-		goto out;
-	}
 
-	/* We are NOT going to update the last two 'status' bytes */
-	memcpy(&resp, &req, sizeof(req.msg));
+	/* The last two 'status' bytes are only written back if set_bmc */
+	memcpy(&resp, &req, sizeof(req.raw));
 
-	sizepg = context->size >> context->pgsize;
 	basepg = context->base >> context->pgsize;
 	MSG_OUT("Got data in with command %d\n", req.msg.command);
+	if ((context->suspended || context->draining) &&
+			needs_flash(req.msg.command)) {
+		MSG_OUT("Flash is suspended, host will have to retry\n");
+		resp.msg.response = MBOX_R_BUSY;
+		goto respond;
+	}
+
 	switch (req.msg.command) {
 		case MBOX_C_RESET_STATE:
 			/* Called by early hostboot? TODO */
+			context->api_version = MBOX_API_VERSION_1;
+			context->caps = 0;
+			context->pgsize = MBOX_BLOCK_SHIFT_DEFAULT;
+			context->writing = false;
+			txn_abort(context);
 			resp.msg.response = MBOX_R_SUCCESS;
 			r = point_to_flash(context);
 			if (r) {
@@ -207,11 +396,9 @@ static int dispatch_mbox(struct mbox_context *context)
 			}
 			break;
 		case MBOX_C_GET_MBOX_INFO:
-			/* TODO Freak if data.data[0] isn't 1 */
-			resp.msg.data[0] = 1;
-			put_u16(&resp.msg.data[1], sizepg);
-			put_u16(&resp.msg.data[3], sizepg);
-			resp.msg.response = MBOX_R_SUCCESS;
+			resp.msg.response = mbox_info(context, &req, &resp);
+			if (resp.msg.response != MBOX_R_SUCCESS)
+				break;
 			/* Wow that can't stay negated thats horrible */
 			MSG_OUT("LPC_CTRL_IOCTL_MAP to 0x%08x for 0x%08x\n", map.addr, map.size);
 			r = ioctl(context->fds[LPC_CTRL_FD].fd,
@@ -223,8 +410,8 @@ static int dispatch_mbox(struct mbox_context *context)
 			}
 			break;
 		case MBOX_C_GET_FLASH_INFO:
-			put_u32(&resp.msg.data[0], context->mtd_info.size);
-			put_u32(&resp.msg.data[4], context->mtd_info.erasesize);
+			put_u32(&resp.msg.data[0], context->flash->mtd_info.size);
+			put_u32(&resp.msg.data[4], context->flash->mtd_info.erasesize);
 			resp.msg.response = MBOX_R_SUCCESS;
 			break;
 		case MBOX_C_READ_WINDOW:
@@ -236,75 +423,84 @@ static int dispatch_mbox(struct mbox_context *context)
 			 * the window...
 			 * This approach is easiest.
 			 */
-			if (context->dirty) {
-				r = read(context->fds[MTD_FD].fd, context->lpc_mem, context->size);
-				if (r != context->size) {
-					MSG_ERR("Short read: %d expecting %"PRIu32"\n", r, context->size);
-					goto out;
-				}
-			}
+			resp.msg.response = window_fill(context, req.msg.seq,
+					arrived);
 			basepg += get_u16(&req.msg.data[0]);
 			put_u16(&resp.msg.data[0], basepg);
-			resp.msg.response = MBOX_R_SUCCESS;
-			context->dirty = false;
+			context->writing = false;
 			break;
 		case MBOX_C_CLOSE_WINDOW:
+			/* Start refreshing the window while the host is away */
+			if (!context->prefetch) {
+				notify_state(context, MBOX_BMC_EVT_CACHE_READY,
+						false);
+				context->prefetch = sched_submit(context,
+						MBOX_SCHED_PREFETCH, req.msg.seq,
+						arrived, 0, context->size);
+				if (context->prefetch)
+					context->prefetch->fill = true;
+			}
 			context->dirty = true;
+			context->writing = false;
+			resp.msg.response = MBOX_R_SUCCESS;
 			break;
 		case MBOX_C_WRITE_WINDOW:
+			/* The host is about to write, the fill can't race it */
+			resp.msg.response = window_fill(context, req.msg.seq,
+					arrived);
 			basepg += get_u16(&req.msg.data[0]);
 			put_u16(&resp.msg.data[0], basepg);
-			resp.msg.response = MBOX_R_SUCCESS;
-			context->dirtybase = basepg << context->pgsize;
+			context->dirtybase = (uint32_t)basepg << context->pgsize;
+			context->writing = true;
 			break;
 		/* Optimise these later */
 		case MBOX_C_WRITE_DIRTY:
 		case MBOX_C_WRITE_FENCE:
 			dirtypg = get_u16(&req.msg.data[0]);
 			dirtycount = get_u32(&req.msg.data[2]);
-			if (dirtycount == 0) {
-				resp.msg.response = MBOX_R_PARAM_ERROR;
+			resp.msg.response = dirty_range(context, dirtypg,
+					dirtycount, &dirtypos);
+			if (resp.msg.response != MBOX_R_SUCCESS)
+				break;
+			if (context->txn) {
+				txn_stage(context, dirtypos, dirtycount);
+				if (req.msg.command == MBOX_C_WRITE_FENCE)
+					resp.msg.response = txn_commit(context,
+							req.msg.seq, arrived);
 				break;
 			}
-			/*
-			 * dirtypg is actually offset within window so we probs
-			 * need to know if the window isn't at zero
-			 */
-			if (flash_write(context, dirtypg << context->pgsize, dirtycount) != 0) {
-				resp.msg.response = MBOX_R_WRITE_ERROR;
+			work = sched_submit(context, MBOX_SCHED_FLUSH, req.msg.seq,
+					arrived, dirtypos, dirtycount);
+			if (!work) {
+				resp.msg.response = MBOX_R_SYSTEM_ERROR;
 				break;
 			}
-			resp.msg.response = MBOX_R_SUCCESS;
+			resp.msg.response = sched_wait(context, work,
+					context->caps & MBOX_CAP_ASYNC);
+			break;
+		case MBOX_C_WRITE_DIRTY_LIST:
+			if (!(context->caps & MBOX_CAP_DIRTY_LIST)) {
+				MSG_ERR("WRITE_DIRTY_LIST wasn't negotiated\n");
+				resp.msg.response = MBOX_R_PARAM_ERROR;
+				break;
+			}
+			resp.msg.response = dirty_list(context, &req, arrived);
 			break;
 		case MBOX_C_ACK:
 			resp.msg.response = MBOX_R_SUCCESS;
-			pos = lseek(context->fds[MBOX_FD].fd, MBOX_BMC_BYTE, SEEK_SET);
-			if (pos != MBOX_BMC_BYTE) {
-				r = -errno;
-				MSG_ERR("Couldn't lseek() to byte %d: %s\n", MBOX_BMC_BYTE,
-						strerror(errno));
-			}
 			/*
-			 * NAND what is in the hardware and the request.
-			 * This prevents the host being able to SET bits, it can
-			 * only request set ones be cleared.
+			 * Clear what is set in both the hardware and the
+			 * request. This prevents the host being able to SET
+			 * bits, it can only request set ones be cleared.
 			 */
-			byte = ~(req.msg.data[0] & req.raw[MBOX_BMC_BYTE]);
-			len = write(context->fds[MBOX_FD].fd, &byte, 1);
-			if (len != 1) {
-				r = -errno;
-				MSG_ERR("Couldn't write to BMC status reg: %s\n",
-						strerror(errno));
-			}
-			pos = lseek(context->fds[MBOX_FD].fd, 0, SEEK_SET);
-			if (pos != 0) {
-				r = -errno;
-				MSG_ERR("Couldn't reset MBOX offset to zero\n");
-			}
+			notify_ack(context, req.raw[MBOX_BMC_BYTE],
+					req.msg.data[0]);
+			set_bmc = true;
 			break;
 		case MBOX_C_COMPLETED_COMMANDS:
-			/* This implementation always completes before responding */
-			resp.msg.data[0] = 0;
+			/* Anything answered with MBOX_R_TIMEOUT shows up here */
+			resp.msg.data[0] = sched_completed(context,
+					&resp.msg.data[1], MBOX_DATA_BYTES - 1);
 			resp.msg.response = MBOX_R_SUCCESS;
 			break;
 		default:
@@ -313,76 +509,401 @@ static int dispatch_mbox(struct mbox_context *context)
 			r = -1;
 	}
 
+respond:
+	/* Any pending notification goes out with the response */
+	if (notify_dirty(context))
+		set_bmc = true;
+	resp.raw[MBOX_BMC_BYTE] = notify_status(context);
+
 	MSG_OUT("Writing response to MBOX regs\n");
-	len = write(context->fds[MBOX_FD].fd, &resp, sizeof(resp.msg));
-	if (len < sizeof(resp.msg)) {
-		r = -errno;
-		MSG_ERR("Didn't write the full response\n");
-	}
+	rc = mbox_regs_write_resp(context, &resp, set_bmc);
+	if (rc)
+		r = rc;
+	else if (set_bmc)
+		notify_written(context, resp.raw[MBOX_BMC_BYTE]);
 
 out:
+	mbox_regs_end(context);
 	return r;
 }
 
-int copy_flash(struct mbox_context *context)
+void signal_hup(int signum, siginfo_t *info, void *uc)
+{
+	sighup = 1;
+}
+
+/* Parse size[K | M], returns 0 on success */
+static int parse_size(const char *arg, uint32_t *size)
+{
+	char *endptr;
+
+	*size = strtol(arg, &endptr, 0);
+	if (arg == endptr) {
+		fprintf(stderr, "Unparseable size\n");
+		return -1;
+	}
+	if (*endptr == 'K') {
+		*size <<= 10;
+	} else if (*endptr == 'M') {
+		*size <<= 20;
+	} else if (*endptr != '\0') { /* Unknown units */
+		fprintf(stderr, "Unknown units '%c'\n", *endptr);
+		return -1;
+	}
+
+	return 0;
+}
+
+static void usage(const char *name)
 {
+	fprintf(stderr, "Usage %s [ -v[v] | --syslog ] --flash=size[K | M] "
+			"[ --host=mbox,lpc[,mtd] ... ]\n", name);
+	fprintf(stderr, "\t--flash size[K | M]\t "
+			"Map the flash for the according to 'size' in "
+			"Kilobytes or Megabytes\n");
+	fprintf(stderr, "\t--host mbox,lpc[,mtd]\t "
+			"Serve the host behind the 'mbox' and 'lpc' devices, "
+			"may be repeated\n");
+	fprintf(stderr, "\t--weight n\t "
+			"Share of flash time for the preceding host, "
+			"relative to others\n");
+	fprintf(stderr, "\t--budget ms\t "
+			"Flash time per second the preceding host gets while "
+			"others wait\n");
+	fprintf(stderr, "\t--transactional\t "
+			"Hold host writes back until WRITE_FENCE, then "
+			"commit them together\n");
+	fprintf(stderr, "\t--journal path\t "
+			"Journal the preceding host's commits here first, "
+			"implies --transactional\n");
+	fprintf(stderr, "\t--mtd /dev/mtdN\t "
+			"Use this MTD for the preceding host\n");
+	fprintf(stderr, "\t--mtd-name name\t "
+			"Use the MTD with exactly this name for the "
+			"preceding host\n");
+	fprintf(stderr, "\t--image path\t "
+			"Serve the preceding host from a PNOR image file "
+			"rather than a MTD\n");
+	fprintf(stderr, "\t--mirror mtd\t "
+			"Copy writes to the preceding host's flash to this "
+			"secondary chip too\n");
+	fprintf(stderr, "\t--overlay ram|path\t "
+			"Keep host writes off the SPI, in RAM or a file, "
+			"until flattened\n");
+	fprintf(stderr, "\t--overlay-range offset,size[K | M]\t "
+			"Only overlay this part of the flash, may be "
+			"repeated\n");
+	fprintf(stderr, "\t--control path\t "
+			"Accept BMC side suspend/flush/invalidate requests "
+			"on this socket\n");
+	fprintf(stderr, "\t--verbose\t Be [more] verbose\n");
+	fprintf(stderr, "\t--syslog\t "
+			"Log output to syslog (pointless without -v)\n");
+	fprintf(stderr, "\t--index path\t "
+			"Keep the CRC index of each flash's erase blocks "
+			"here across restarts\n");
+	fprintf(stderr, "\t--scan\t "
+			"Check the flash against the CRC index in the "
+			"background at startup\n");
+	fprintf(stderr, "\t--scrub rate[K | M]\t "
+			"Re-read the window at 'rate' bytes a second while "
+			"hosts are idle\n");
+	fprintf(stderr, "\t--wear path\t "
+			"Keep each flash's per erase block wear and timing "
+			"counts here across restarts\n");
+	fprintf(stderr, "\t--verify\t "
+			"Read back what's programmed, programming or erasing "
+			"again what didn't take\n");
+	fprintf(stderr, "\t--ecc\t "
+			"Check and correct ECC partitions as they're loaded "
+			"and written back\n");
+	fprintf(stderr, "\t--write-window size[K | M]\t "
+			"Limit the write window offered to version 2 hosts\n");
+	fprintf(stderr, "\t--notify-delay ms\t "
+			"Hold back BMC status updates for up to 'ms'\n");
+	fprintf(stderr, "\t--notify-count n\t "
+			"Unless 'n' have built up (with --notify-delay)\n\n");
+}
+
+/*
+ * A new host, configured as per the command line options in 'defaults'.
+ * 'spec' is mbox,lpc[,mtd]; NULL means the single host setup.
+ */
+struct host_opts {
+	const char *spec;
+	unsigned int weight;
+	unsigned int budget_ms;
+	const char *journal;
+	const char *image;
+	const char *mirror;
+	const char *mtd;
+	const char *mtd_name;
+};
+
+static struct mbox_context *context_new(struct mbox_context *defaults,
+		struct host_opts *opts, unsigned int id)
+{
+	const char *spec = opts->spec;
+	struct mbox_context *context;
+	char *mtd;
+	int i;
+
+	context = malloc(sizeof(*context));
+	if (!context)
+		return NULL;
+
+	*context = *defaults;
+	context->id = id;
+	for (i = 0; i < TOTAL_FDS; i++)
+		context->fds[i].fd = -1;
+	context->journal_fd = -1;
+
+	if (!spec) {
+		context->mbox_path = strdup(MBOX_HOST_PATH);
+		context->lpc_path = strdup(LPC_CTRL_PATH);
+		context->mtd_path = NULL;
+	} else {
+		context->mbox_path = strdup(spec);
+		context->lpc_path = strchr(context->mbox_path, ',');
+		if (!context->lpc_path) {
+			fprintf(stderr, "Host '%s' has no LPC control device\n", spec);
+			free(context->mbox_path);
+			free(context);
+			return NULL;
+		}
+		*context->lpc_path++ = '\0';
+		context->lpc_path = strdup(context->lpc_path);
+		mtd = strchr(context->lpc_path, ',');
+		if (mtd)
+			*mtd++ = '\0';
+		context->mtd_path = mtd ? strdup(mtd) : NULL;
+	}
+
+	if (opts->image || opts->mtd) {
+		free(context->mtd_path);
+		context->mtd_path = strdup(opts->image ? opts->image : opts->mtd);
+	}
+
+	if (!context->mtd_path)
+		context->mtd_path = get_dev_mtd(opts->mtd_name);
+	if (context->mtd_path)
+		MSG_OUT("Host %u: flash is %s\n", id, context->mtd_path);
+
+	if (opts->journal) {
+		context->txn = true;
+		context->journal_path = strdup(opts->journal);
+	}
+
+	context->client.weight = opts->weight;
+	context->client.budget_ns = opts->budget_ms * 1000000ULL;
+	sched_client_init(&context->client, context->mbox_path);
+	sched_client_init(&context->scrub_client, "scrub");
+
+	return context;
+}
+
+static int context_init(struct mbox_context *context)
+{
+	struct aspeed_lpc_ctrl_mapping map;
 	int r;
 
-	/*
-	 * Copy flash into RAM early, same time.
-	 * The kernel has created the LPC->AHB mapping also, which means
-	 * flash should work.
-	 * Ideally we tell the kernel whats up and when to do stuff...
-	 */
-	MSG_OUT("Loading flash into ram at %p for 0x%08x bytes\n",
-		context->lpc_mem, context->size);
-	if (lseek(context->fds[MTD_FD].fd, 0, SEEK_SET) != 0) {
+	MSG_OUT("Opening %s\n", context->mbox_path);
+	context->fds[MBOX_FD].fd = open(context->mbox_path, O_RDWR | O_NONBLOCK);
+	if (context->fds[MBOX_FD].fd < 0) {
 		r = -errno;
-		MSG_ERR("Couldn't reset MBOX pos to zero\n");
+		MSG_ERR("Couldn't open %s with flags O_RDWR: %s\n",
+				context->mbox_path, strerror(errno));
 		return r;
 	}
-	r = read(context->fds[MTD_FD].fd, context->lpc_mem, context->size);
-	if (r != context->size) {
+
+	MSG_OUT("Opening %s\n", context->lpc_path);
+	context->fds[LPC_CTRL_FD].fd = open(context->lpc_path, O_RDWR | O_SYNC);
+	if (context->fds[LPC_CTRL_FD].fd < 0) {
 		r = -errno;
-		MSG_ERR("Couldn't copy mtd into ram: %d\n", r);
+		MSG_ERR("Couldn't open %s with flags O_RDWR: %s\n",
+				context->lpc_path, strerror(errno));
 		return r;
 	}
-	return 0;
+
+	MSG_OUT("Getting buffer size...\n");
+	/* Until a version 2 host negotiates something else */
+	context->pgsize = MBOX_BLOCK_SHIFT_DEFAULT;
+	map.window_type = ASPEED_LPC_CTRL_WINDOW_MEMORY;
+	map.window_id = 0; /* Theres only one */
+	if (ioctl(context->fds[LPC_CTRL_FD].fd, ASPEED_LPC_CTRL_IOCTL_GET_SIZE,
+				&map) < 0) {
+		r = -errno;
+		MSG_OUT("fail\n");
+		MSG_ERR("Couldn't get lpc control buffer size: %s\n", strerror(-r));
+		return r;
+	}
+	/* And strip the first nibble, LPC access speciality */
+	context->size = map.size;
+	context->base = -context->size & 0x0FFFFFFF;
+	/* Everything in the window is addressed as an offset into the flash */
+	if (context->flash->mtd_info.size < context->size) {
+		MSG_ERR("%s is 0x%08x bytes, smaller than the 0x%08x byte window\n",
+				context->flash->path,
+				context->flash->mtd_info.size, context->size);
+		return -EINVAL;
+	}
+	if (!context->write_size || context->write_size > context->size)
+		context->write_size = context->size;
+	context->api_version = MBOX_API_VERSION_1;
+
+	/* READ THE COMMENT AT THE START OF THIS FUNCTION! */
+	r = point_to_flash(context);
+	if (r) {
+		MSG_ERR("Failed to point the LPC BUS at the actual flash: %s\n",
+				strerror(-r));
+		return r;
+	}
+
+	MSG_OUT("Mapping %s for %u\n", context->lpc_path, context->size);
+	context->lpc_mem = mmap(NULL, context->size, PROT_READ | PROT_WRITE, MAP_SHARED,
+			context->fds[LPC_CTRL_FD].fd, 0);
+	if (context->lpc_mem == MAP_FAILED) {
+		r = -errno;
+		context->lpc_mem = NULL;
+		MSG_ERR("Didn't manage to mmap %s: %s\n", context->lpc_path,
+				strerror(errno));
+		return r;
+	}
+
+	r = txn_init(context);
+	if (r)
+		return r;
+
+	/* Before anything is read, the flash may be mid-commit */
+	r = txn_replay(context);
+	if (r)
+		return r;
+
+	r = ecc_init(context);
+	if (r)
+		return r;
+
+	r = copy_flash(context);
+	if (r)
+		return r;
+
+	/* Catch the secondary up in the background */
+	sched_mirror(context);
+
+	/* Also in the background, once per flash however many hosts share it */
+	if (context->scan && !context->flash->scan_work &&
+			!context->flash->scan_stats.scans) {
+		r = scan_start(context, NULL);
+		if (r)
+			return r;
+	}
+
+	context->fds[MBOX_FD].events = POLLIN;
+
+	MSG_OUT("Setting all MBOX regs to 0xff...\n");
+	r = mbox_regs_fill(context, 0xff);
+	if (r)
+		return r;
+
+	/* Tell the host we've (re)started and have the flash loaded */
+	r = notify_init(context);
+	if (r)
+		return r;
+	notify_state(context, MBOX_BMC_EVT_CACHE_READY, true);
+
+	return notify_flush(context);
 }
 
-void signal_hup(int signum, siginfo_t *info, void *uc)
+static void context_free(struct mbox_context *context)
 {
-	sighup = 1;
+	sched_client_dump(&context->client);
+	sched_free(context);
+	txn_free(context);
+	notify_free(context);
+	if (context->lpc_mem)
+		munmap(context->lpc_mem, context->size);
+
+	flash_put(context->flash);
+	close(context->fds[LPC_CTRL_FD].fd);
+	close(context->fds[MBOX_FD].fd);
+	free(context->mbox_path);
+	free(context->lpc_path);
+	free(context->mtd_path);
+	free(context);
 }
 
-static void usage(const char *name)
+/* Reload everything, the flash has been changed behind our back */
+static int reload(struct mbox_context **contexts, int n)
 {
-	fprintf(stderr, "Usage %s [ -v[v] | --syslog ] --flash=size[K | M]\n", name);
-	fprintf(stderr, "\t--flash size[K | M]\t Map the flash for the according to 'size' in Kilobytes or Megabytes\n");
-	fprintf(stderr, "\t--verbose\t Be [more] verbose\n");
-	fprintf(stderr, "\t--syslog\t Log output to syslog (pointless without -v)\n\n");
+	int i, r;
+
+	for (i = 0; i < n; i++) {
+		txn_abort(contexts[i]);
+		while (sched_pending(contexts[i]))
+			sched_step(contexts[i]);
+		flash_cache_drop(contexts[i]->flash);
+	}
+
+	for (i = 0; i < n; i++) {
+		r = point_to_flash(contexts[i]);
+		if (r)
+			return r;
+		r = copy_flash(contexts[i]);
+		if (r)
+			return r;
+	}
+
+	return 0;
 }
 
 int main(int argc, char *argv[])
 {
-	struct mbox_context *context;
-	const char *name = argv[0];
-	char *pnor_filename = NULL;
-	int opt, polled, r, i;
-	struct aspeed_lpc_ctrl_mapping map;
+	struct mbox_context defaults = { 0 }, **contexts = NULL;
+	const char *name = argv[0], *ctrl_path = NULL;
+	struct mbox_ctrl ctrl = { .fd = -1 };
+	struct pollfd *fds = NULL;
+	struct host_opts *hosts;
+	int opt, polled, r = 0, i, j, n = 0;
+	bool notify_count = false;
 	struct sigaction act;
 	char *endptr;
 
 	static const struct option long_options[] = {
 		{ "flash",   required_argument, 0, 'f' },
+		{ "host",    required_argument, 0, 'H' },
+		{ "weight",  required_argument, 0, 'W' },
+		{ "budget",  required_argument, 0, 'B' },
+		{ "control", required_argument, 0, 'C' },
+		{ "transactional", no_argument, 0, 't' },
+		{ "journal", required_argument, 0, 'j' },
+		{ "image", required_argument, 0, 'i' },
+		{ "mirror", required_argument, 0, 'm' },
+		{ "mtd", required_argument, 0, 'M' },
+		{ "mtd-name", required_argument, 0, 'N' },
+		{ "overlay", required_argument, 0, 'O' },
+		{ "overlay-range", required_argument, 0, 'R' },
 		{ "verbose", no_argument,       0, 'v' },
 		{ "syslog",  no_argument,       0, 's' },
+		{ "ecc", no_argument, 0, 'e' },
+		{ "index", required_argument, 0, 'I' },
+		{ "scan", no_argument, 0, 'S' },
+		{ "scrub", required_argument, 0, 'r' },
+		{ "verify", no_argument, 0, 'V' },
+		{ "wear", required_argument, 0, 'E' },
+		{ "write-window", required_argument, 0, 'w' },
+		{ "notify-count", required_argument, 0, 'c' },
+		{ "notify-delay", required_argument, 0, 'd' },
 		{ 0,	     0,		            0,  0  }
 	};
 
-	context = calloc(1, sizeof(*context));
-	for (i = 0; i < TOTAL_FDS; i++)
-		context->fds[i].fd = -1;
+	defaults.notify_count = 1;
+
+	/* Room for the default host, which --weight and --budget apply to */
+	hosts = calloc(1, sizeof(*hosts));
+	if (!hosts) {
+		perror("Adding host");
+		exit(EXIT_FAILURE);
+	}
 
 	mbox_vlog = &mbox_log_console;
 	while ((opt = getopt_long(argc, argv, "fv", long_options, NULL)) != -1) {
@@ -390,18 +911,77 @@ int main(int argc, char *argv[])
 			case 0:
 				break;
 			case 'f':
-				context->flash_size = strtol(optarg, &endptr, 0);
-				if (optarg == endptr) {
-					fprintf(stderr, "Unparseable flash size\n");
+				if (parse_size(optarg, &defaults.flash_size)) {
 					usage(name);
 					exit(EXIT_FAILURE);
 				}
-				if (*endptr == 'K') {
-					context->flash_size <<= 10;
-				} else if (*endptr == 'M') {
-					context->flash_size <<= 20;
-				} else if (*endptr != '\0') { /* Unknown units */
-					fprintf(stderr, "Unknown units '%c'\n", *endptr);
+				break;
+			case 'H':
+				hosts = realloc(hosts, (n + 1) * sizeof(*hosts));
+				if (!hosts) {
+					perror("Adding host");
+					exit(EXIT_FAILURE);
+				}
+				memset(&hosts[n], 0, sizeof(*hosts));
+				hosts[n++].spec = optarg;
+				break;
+			case 'W':
+				hosts[n ? n - 1 : 0].weight = strtoul(optarg, &endptr, 0);
+				if (optarg == endptr || *endptr != '\0') {
+					fprintf(stderr, "Unparseable weight\n");
+					usage(name);
+					exit(EXIT_FAILURE);
+				}
+				break;
+			case 'B':
+				hosts[n ? n - 1 : 0].budget_ms = strtoul(optarg, &endptr, 0);
+				if (optarg == endptr || *endptr != '\0' ||
+						hosts[n ? n - 1 : 0].budget_ms > 1000) {
+					fprintf(stderr, "Unparseable budget\n");
+					usage(name);
+					exit(EXIT_FAILURE);
+				}
+				break;
+			case 'C':
+				ctrl_path = optarg;
+				break;
+			case 't':
+				defaults.txn = true;
+				break;
+			case 'j':
+				hosts[n ? n - 1 : 0].journal = optarg;
+				break;
+			case 'i':
+				hosts[n ? n - 1 : 0].image = optarg;
+				break;
+			case 'm':
+				hosts[n ? n - 1 : 0].mirror = optarg;
+				break;
+			case 'M':
+				hosts[n ? n - 1 : 0].mtd = optarg;
+				break;
+			case 'N':
+				hosts[n ? n - 1 : 0].mtd_name = optarg;
+				break;
+			case 'O':
+				flash_overlay_policy(optarg);
+				break;
+			case 'R':
+			{
+				uint32_t pos, len;
+
+				pos = strtoul(optarg, &endptr, 0);
+				if (optarg == endptr || *endptr != ',' ||
+						parse_size(endptr + 1, &len) ||
+						flash_overlay_range(pos, len)) {
+					fprintf(stderr, "Unparseable overlay range\n");
+					usage(name);
+					exit(EXIT_FAILURE);
+				}
+				break;
+			}
+			case 'w':
+				if (parse_size(optarg, &defaults.write_size)) {
 					usage(name);
 					exit(EXIT_FAILURE);
 				}
@@ -416,18 +996,63 @@ int main(int argc, char *argv[])
 					mbox_vlog = &vsyslog;
 				}
 				break;
+			case 'e':
+				defaults.ecc = true;
+				break;
+			case 'I':
+				scan_index_policy(optarg);
+				break;
+			case 'S':
+				defaults.scan = true;
+				break;
+			case 'r':
+				if (parse_size(optarg, &defaults.scrub_rate)) {
+					usage(name);
+					exit(EXIT_FAILURE);
+				}
+				break;
+			case 'V':
+				defaults.verify = true;
+				break;
+			case 'E':
+				wear_policy(optarg);
+				break;
+			case 'c':
+				defaults.notify_count = strtoul(optarg, &endptr, 0);
+				if (optarg == endptr || *endptr != '\0') {
+					fprintf(stderr, "Unparseable notification count\n");
+					usage(name);
+					exit(EXIT_FAILURE);
+				}
+				notify_count = true;
+				break;
+			case 'd':
+				defaults.notify_delay_ms = strtoul(optarg, &endptr, 0);
+				if (optarg == endptr || *endptr != '\0') {
+					fprintf(stderr, "Unparseable notification delay\n");
+					usage(name);
+					exit(EXIT_FAILURE);
+				}
+				break;
 			default:
 				usage(name);
 				exit(EXIT_FAILURE);
 		}
 	}
 
-	if (context->flash_size == 0) {
+	if (defaults.flash_size == 0) {
 		fprintf(stderr, "Must specify a non-zero flash size\n");
 		usage(name);
 		exit(EXIT_FAILURE);
 	}
 
+	/* Nothing is held back to count without a delay */
+	if (notify_count && !defaults.notify_delay_ms) {
+		fprintf(stderr, "--notify-count needs a non-zero --notify-delay\n");
+		usage(name);
+		exit(EXIT_FAILURE);
+	}
+
 	if (verbosity == MBOX_LOG_VERBOSE)
 		MSG_OUT("Verbose logging\n");
 
@@ -446,122 +1071,90 @@ int main(int argc, char *argv[])
 
 	MSG_OUT("Starting\n");
 
-	MSG_OUT("Opening %s\n", MBOX_HOST_PATH);
-	context->fds[MBOX_FD].fd = open(MBOX_HOST_PATH, O_RDWR | O_NONBLOCK);
-	if (context->fds[MBOX_FD].fd < 0) {
-		r = -errno;
-		MSG_ERR("Couldn't open %s with flags O_RDWR: %s\n",
-				MBOX_HOST_PATH, strerror(errno));
-		goto finish;
-	}
-
-	MSG_OUT("Opening %s\n", LPC_CTRL_PATH);
-	context->fds[LPC_CTRL_FD].fd = open(LPC_CTRL_PATH, O_RDWR | O_SYNC);
-	if (context->fds[LPC_CTRL_FD].fd < 0) {
-		r = -errno;
-		MSG_ERR("Couldn't open %s with flags O_RDWR: %s\n",
-				LPC_CTRL_PATH, strerror(errno));
+	if (n == 0)
+		n = 1;
+	contexts = calloc(n, sizeof(*contexts));
+	fds = calloc(n * POLL_FDS + MBOX_CTRL_FDS, sizeof(*fds));
+	if (!contexts || !fds) {
+		r = -ENOMEM;
 		goto finish;
 	}
 
-	MSG_OUT("Getting buffer size...\n");
-	/* This may become more variable in the future */
-	context->pgsize = 12; /* 4K */
-	map.window_type = ASPEED_LPC_CTRL_WINDOW_MEMORY;
-	map.window_id = 0; /* Theres only one */
-	if (ioctl(context->fds[LPC_CTRL_FD].fd, ASPEED_LPC_CTRL_IOCTL_GET_SIZE,
-				&map) < 0) {
-		r = -errno;
-		MSG_OUT("fail\n");
-		MSG_ERR("Couldn't get lpc control buffer size: %s\n", strerror(-r));
-		goto finish;
-	}
-	/* And strip the first nibble, LPC access speciality */
-	context->size = map.size;
-	context->base = -context->size & 0x0FFFFFFF;
-
-	/* READ THE COMMENT AT THE START OF THIS FUNCTION! */
-	r = point_to_flash(context);
-	if (r) {
-		MSG_ERR("Failed to point the LPC BUS at the actual flash: %s\n",
-				strerror(-r));
-		goto finish;
-	}
-
-	MSG_OUT("Mapping %s for %u\n", LPC_CTRL_PATH, context->size);
-	context->lpc_mem = mmap(NULL, context->size, PROT_READ | PROT_WRITE, MAP_SHARED,
-			context->fds[LPC_CTRL_FD].fd, 0);
-	if (context->lpc_mem == MAP_FAILED) {
-		r = -errno;
-		MSG_ERR("Didn't manage to mmap %s: %s\n", LPC_CTRL_PATH, strerror(errno));
-		goto finish;
+	/* Open every MTD first so that we know which ones are shared */
+	for (i = 0; i < n; i++) {
+		contexts[i] = context_new(&defaults, &hosts[i], i);
+		if (!contexts[i]) {
+			r = -1;
+			goto finish;
+		}
+		if (!contexts[i]->mtd_path) {
+			MSG_ERR("Couldn't find the PNOR MTD in %s\n", MTD_SYSFS);
+			r = -1;
+			goto finish;
+		}
+		contexts[i]->flash = flash_get(contexts[i]->mtd_path);
+		if (!contexts[i]->flash) {
+			r = -1;
+			goto finish;
+		}
 	}
 
-	pnor_filename = get_dev_mtd();
-	if (!pnor_filename) {
-		MSG_ERR("Couldn't find the PNOR /dev/mtd partition\n");
-		r = -1;
-		goto finish;
-	}
+	sched_hosts(contexts, n);
 
-	MSG_OUT("Opening %s\n", pnor_filename);
-	context->fds[MTD_FD].fd = open(pnor_filename, O_RDWR);
-	if (context->fds[MTD_FD].fd < 0) {
-		r = -errno;
-		MSG_ERR("Couldn't open %s with flags O_RDWR: %s\n",
-				pnor_filename, strerror(errno));
-		goto finish;
+	/* Once every primary is known, none of them can be a secondary */
+	for (i = 0; i < n; i++) {
+		if (!hosts[i].mirror)
+			continue;
+		r = flash_mirror(contexts[i]->flash, hosts[i].mirror);
+		if (r)
+			goto finish;
 	}
 
-	if (ioctl(context->fds[MTD_FD].fd, MEMGETINFO, &context->mtd_info) == -1) {
-		MSG_ERR("Couldn't get information about MTD: %s\n", strerror(errno));
-		return -1;
+	for (i = 0; i < n; i++) {
+		MSG_OUT("Setting up host %d\n", i);
+		r = context_init(contexts[i]);
+		if (r)
+			goto finish;
 	}
 
-	if (copy_flash(context))
+	r = ctrl_init(&ctrl, ctrl_path, contexts, n);
+	if (r)
 		goto finish;
 
-	context->fds[MBOX_FD].events = POLLIN;
-
-	/* Test the single write facility by setting all the regs to 0xFF */
-	MSG_OUT("Setting all MBOX regs to 0xff individually...\n");
-	for (i = 0; i < MBOX_REG_BYTES; i++) {
-		uint8_t byte = 0xff;
-		off_t pos;
-		int len;
-
-		pos = lseek(context->fds[MBOX_FD].fd, i, SEEK_SET);
-		if (pos != i) {
-			MSG_ERR("Couldn't lseek() to byte %d: %s\n", i,
-					strerror(errno));
-			break;
+	MSG_OUT("Entering polling loop\n");
+	while (running) {
+		/*
+		 * Status changes from the last trip round, whether from a
+		 * host command, the control socket or background work, go
+		 * out before we sleep
+		 */
+		for (i = 0; i < n; i++) {
+			r = notify_poll(contexts[i]);
+			if (r < 0)
+				break;
 		}
-		len = write(context->fds[MBOX_FD].fd, &byte, 1);
-		if (len != 1) {
-			MSG_ERR("Couldn't write MBOX reg %d: %s\n", i,
-					strerror(errno));
+		if (r < 0) {
+			MSG_ERR("Couldn't notify the host: %s\n", strerror(-r));
 			break;
 		}
-	}
-	if (lseek(context->fds[MBOX_FD].fd, 0, SEEK_SET) != 0) {
-		r = -errno;
-		MSG_ERR("Couldn't reset MBOX pos to zero\n");
-		goto finish;
-	}
 
-	MSG_OUT("Entering polling loop\n");
-	while (running) {
-		polled = poll(context->fds, POLL_FDS, 1000);
-		if (polled == 0)
+		for (i = 0; i < n; i++)
+			memcpy(&fds[i * POLL_FDS], contexts[i]->fds,
+					POLL_FDS * sizeof(*fds));
+		ctrl_pollfds(&ctrl, &fds[n * POLL_FDS]);
+
+		/* Keep background work moving between mbox commands */
+		polled = poll(fds, n * POLL_FDS + MBOX_CTRL_FDS,
+				sched_pending_any(contexts, n) ? 0 :
+				sched_idle(contexts, n));
+		if (polled == 0) {
+			sched_step_any(contexts, n);
 			continue;
+		}
 		if ((polled == -1) && (errno != -EINTR) && (sighup == 1)) {
-			/* Got sighup. reset to point to flash and
-			 * reread flash */
-			r = point_to_flash(context);
-			if (r) {
-				goto finish;
-			}
-			r = copy_flash(context);
+			/* Got sighup. Write back anything outstanding, reset
+			 * to point to flash and reread flash */
+			r = reload(contexts, n);
 			if (r)
 				goto finish;
 			sighup = 0;
@@ -572,25 +1165,44 @@ int main(int argc, char *argv[])
 			MSG_ERR("Error from poll(): %s\n", strerror(errno));
 			break;
 		}
-		r = dispatch_mbox(context);
-		if (r < 0) {
-			MSG_ERR("Error handling MBOX event: %s\n", strerror(-r));
-			break;
+		for (i = 0; i < n; i++) {
+			for (j = 0; j < POLL_FDS; j++)
+				contexts[i]->fds[j].revents = fds[i * POLL_FDS + j].revents;
+
+			if (contexts[i]->fds[MBOX_FD].revents & POLLIN) {
+				r = dispatch_mbox(contexts[i]);
+				if (r < 0) {
+					MSG_ERR("Error handling MBOX event: %s\n", strerror(-r));
+					break;
+				}
+			}
+			if (contexts[i]->fds[NOTIFY_FD].revents & POLLIN) {
+				r = notify_timeout(contexts[i]);
+				if (r < 0) {
+					MSG_ERR("Couldn't notify the host: %s\n",
+							strerror(-r));
+					break;
+				}
+			}
 		}
+		if (r < 0)
+			break;
+
+		ctrl_dispatch(&ctrl, &fds[n * POLL_FDS]);
 	}
 
 	MSG_OUT("Exiting\n");
 
 finish:
-	if (context->lpc_mem)
-		munmap(context->lpc_mem, context->size);
-
-	free(pnor_filename);
-	close(context->fds[MTD_FD].fd);
-	close(context->fds[LPC_CTRL_FD].fd);
-	close(context->fds[MBOX_FD].fd);
-	free(context);
+	sched_hosts(NULL, 0);
+	ctrl_free(&ctrl);
+	for (i = 0; contexts && i < n; i++) {
+		if (contexts[i])
+			context_free(contexts[i]);
+	}
+	free(contexts);
+	free(fds);
+	free(hosts);
 
 	return r;
 }
-
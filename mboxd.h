@@ -0,0 +1,240 @@
+/* Copyright 2016 IBM
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *    http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *	Unless required by applicable law or agreed to in writing, software
+ *	distributed under the License is distributed on an "AS IS" BASIS,
+ *	WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *	See the License for the specific language governing permissions and
+ *	limitations under the License.
+ *
+ */
+
+#ifndef MBOXD_H
+#define MBOXD_H
+
+#include <poll.h>
+#include <stdbool.h>
+#include <stdint.h>
+
+#include <mtd/mtd-abi.h>
+
+#include "mboxd_sched.h"
+
+/* Put pulled fds first */
+#define MBOX_FD 0
+#define NOTIFY_FD 1
+#define POLL_FDS 2
+#define LPC_CTRL_FD 2
+#define TOTAL_FDS 3
+
+#define ALIGN_UP(_v, _a)    (((_v) + (_a) - 1) & ~((_a) - 1))
+
+#define MSG_OUT(f_, ...) do { if (verbosity != MBOX_LOG_NONE) { mbox_log(LOG_INFO, f_, ##__VA_ARGS__); } } while(0)
+#define MSG_ERR(f_, ...) do { if (verbosity != MBOX_LOG_NONE) { mbox_log(LOG_ERR, f_, ##__VA_ARGS__); } } while(0)
+
+struct mbox_regs_stats {
+	/* Syscalls spent on the command currently being handled */
+	unsigned int syscalls;
+	/* Worst case seen so far, and running totals */
+	unsigned int max_syscalls;
+	unsigned long total_syscalls;
+	unsigned long commands;
+};
+
+struct mbox_ecc_stats {
+	/* 9 byte ECC words checked */
+	unsigned long long words;
+	unsigned long corrected;
+	unsigned long uncorrectable;
+};
+
+struct mbox_notify_stats {
+	/* Changes to the BMC status byte */
+	unsigned long events;
+	/* Writes of the status byte on its own, ie host interrupts */
+	unsigned long sent;
+	/* Status byte updates that went out with a response */
+	unsigned long piggybacked;
+	/* Changes folded into another write */
+	unsigned long suppressed;
+};
+
+/*
+ * The flash as it was at some point, kept as the old content of each erase
+ * block the first time it is erased afterwards.
+ */
+struct mbox_flash_snap {
+	uint8_t **blocks;
+	unsigned int saved;
+	uint64_t created;
+};
+
+/* An MTD, shared by every host whose PNOR lives on it */
+struct mbox_flash {
+	char *path;
+	int fd;
+	struct mtd_info_user mtd_info;
+	unsigned int users;
+	/*
+	 * With more than one user, a copy of the flash and a bitmap of the
+	 * erase blocks in it that are known to match the flash. Hosts with
+	 * the same content are then filled from here rather than the SPI.
+	 */
+	uint8_t *cache;
+	uint8_t *cached;
+	struct mbox_flash_snap *snap;
+	/* ECC protected partitions, from the FFS table of contents */
+	struct mbox_range *ecc;
+	int ecc_n;
+	bool ecc_parsed;
+	/*
+	 * Host writes that were kept off the SPI: the content of each erase
+	 * block in it, then a bitmap of the blocks present. In RAM or
+	 * mapped from a file.
+	 */
+	uint8_t *overlay;
+	uint8_t *overlay_map;
+	size_t overlay_size;
+	unsigned int overlay_blocks;
+	/* A PNOR image file mapped in place of a MTD, see --image */
+	uint8_t *image;
+	/* Range of the image programmed but not yet synced to the file */
+	uint32_t sync_start;
+	uint32_t sync_end;
+	/*
+	 * The other chip of a primary/secondary pair, see --mirror. Each
+	 * chip numbers the content of its erase blocks: the primary bumps a
+	 * block's generation whenever it changes, the secondary takes the
+	 * primary's once it has the same content.
+	 */
+	struct mbox_flash *mirror;
+	uint32_t *gen;
+	uint32_t gen_next;
+	/* Some block of the primary changed since mirroring was queued */
+	bool mirror_stale;
+	struct mbox_work *mirror_work;
+	uint8_t *mirror_buf;
+	unsigned long mirror_writes;
+	/* Flash time spent on mirroring */
+	struct mbox_client mirror_client;
+	/*
+	 * CRC32C of each erase block of the raw chip as last programmed or
+	 * scanned, the one block index, see mboxd_scan.h
+	 */
+	uint32_t *crc;
+	uint8_t *crc_known;
+	char *index_path;
+	bool index_dirty;
+	struct mbox_work *scan_work;
+	uint8_t *scan_buf;
+	struct mbox_client scan_client;
+	struct {
+		unsigned long scans;
+		unsigned long blocks;
+		unsigned long drifted;
+		unsigned long last_drifted;
+		uint64_t last_ns;
+	} scan_stats;
+	/* Read back of what was just programmed, see --verify */
+	uint8_t *verify_buf;
+	/* Erase and program counts and times per block, see mboxd_wear.h */
+	struct mbox_wear *wear;
+	char *wear_path;
+	bool wear_dirty;
+	uint64_t wear_saved;
+	struct mbox_flash *next;
+};
+
+struct mbox_context {
+	/* Which host this is, for messages */
+	unsigned int id;
+	char *mbox_path;
+	char *lpc_path;
+	char *mtd_path;
+	struct pollfd fds[TOTAL_FDS];
+	void *lpc_mem;
+	uint32_t base;
+	uint32_t size;
+	uint32_t pgsize;
+	bool dirty;
+	uint32_t dirtybase;
+	uint32_t dirtysize;
+	struct mbox_flash *flash;
+	uint32_t flash_size;
+	/* Size of the write window, the read window is the whole region */
+	uint32_t write_size;
+	/* What was agreed with the host in GET_MBOX_INFO */
+	uint8_t api_version;
+	uint8_t caps;
+	/* The BMC has taken the flash over the control socket */
+	bool suspended;
+	/* The BMC waits for the host's queued writes, take no more until then */
+	bool draining;
+	/* Hold dirty blocks back until WRITE_FENCE, see mboxd_txn.h */
+	bool txn;
+	uint8_t *txn_map;
+	unsigned int txn_blocks;
+	unsigned long txn_commits;
+	char *journal_path;
+	int journal_fd;
+	/* A commit's flush is still running, the journal is in use */
+	bool journal_busy;
+	struct mbox_regs_stats regs_stats;
+	/* The host's share of flash time */
+	struct mbox_client client;
+	/* Outstanding flash work, a queue per class, see mboxd_sched.h */
+	struct mbox_work *work[MBOX_SCHED_CLASSES];
+	struct mbox_drain drain[MBOX_SCHED_CLASSES];
+	/* Background refill of the window queued by CLOSE_WINDOW */
+	struct mbox_work *prefetch;
+	/* The last fill of the window stopped short */
+	bool fill_failed;
+	/* Moving average of the cost of each kind of flash operation */
+	uint64_t step_cost[MBOX_OPS];
+	void *scrub_buf;
+	/* Re-read the window this many bytes a second when idle, see sched_idle() */
+	uint32_t scrub_rate;
+	uint32_t scrub_pos;
+	uint64_t scrub_next;
+	struct mbox_client scrub_client;
+	struct {
+		unsigned long blocks;
+		unsigned long passes;
+		unsigned long refreshed;
+		unsigned long errors;
+	} scrub_stats;
+	/* When the host last sent a command, and if it has a write window */
+	uint64_t last_command;
+	bool writing;
+	/* Sequence numbers of background work for COMPLETED_COMMANDS */
+	uint8_t completed[256];
+	unsigned int n_completed;
+	/* BMC status byte as last written, and as it should be */
+	uint8_t bmc_status;
+	uint8_t bmc_want;
+	/* Hold back status writes until this many changes or this long */
+	unsigned int notify_count;
+	unsigned int notify_delay_ms;
+	unsigned int notify_pending;
+	struct mbox_notify_stats notify_stats;
+	/* Scan the flash against the block index at startup */
+	bool scan;
+	/* Check ECC partitions on the way in and out, see mboxd_ecc.h */
+	bool ecc;
+	struct mbox_ecc_stats ecc_stats;
+	/* Read back every program and fix what didn't take */
+	bool verify;
+	struct {
+		unsigned long blocks;
+		unsigned long reprogrammed;
+		unsigned long reerased;
+		unsigned long failed;
+	} verify_stats;
+};
+
+#endif /* MBOXD_H */
@@ -0,0 +1,1302 @@
+/* Copyright 2016 IBM
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *    http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *	Unless required by applicable law or agreed to in writing, software
+ *	distributed under the License is distributed on an "AS IS" BASIS,
+ *	WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *	See the License for the specific language governing permissions and
+ *	limitations under the License.
+ *
+ */
+
+#define _GNU_SOURCE
+#include <endian.h>
+#include <errno.h>
+#include <inttypes.h>
+#include <stdarg.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <syslog.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include "mbox.h"
+#include "common.h"
+#include "mboxd.h"
+#include "mboxd_ctrl.h"
+#include "mboxd_flash.h"
+#include "mboxd_notify.h"
+#include "mboxd_scan.h"
+#include "mboxd_sched.h"
+#include "mboxd_wear.h"
+
+int ctrl_init(struct mbox_ctrl *ctrl, const char *path,
+		struct mbox_context **contexts, int n)
+{
+	struct sockaddr_un addr = { .sun_family = AF_UNIX };
+	int i;
+
+	ctrl->fd = -1;
+	for (i = 0; i < MBOX_CTRL_MAX_CLIENTS; i++)
+		ctrl->clients[i] = -1;
+	memset(&ctrl->update, 0, sizeof(ctrl->update));
+	ctrl->update.client = -1;
+	memset(&ctrl->snapshot, 0, sizeof(ctrl->snapshot));
+	ctrl->snapshot.client = -1;
+	memset(&ctrl->wait, 0, sizeof(ctrl->wait));
+	ctrl->wait.client = -1;
+	ctrl->contexts = contexts;
+	ctrl->n = n;
+	memset(&ctrl->client, 0, sizeof(ctrl->client));
+	sched_client_init(&ctrl->client, "bmc");
+
+	/* No socket, nothing to poll */
+	if (!path)
+		return 0;
+
+	if (strlen(path) >= sizeof(addr.sun_path)) {
+		MSG_ERR("Control socket path %s is too long\n", path);
+		return -ENAMETOOLONG;
+	}
+	strcpy(addr.sun_path, path);
+	ctrl->path = strdup(path);
+
+	ctrl->fd = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0);
+	if (ctrl->fd < 0) {
+		MSG_ERR("Couldn't create control socket: %s\n", strerror(errno));
+		return -errno;
+	}
+
+	/* A previous instance may have left it behind */
+	unlink(path);
+	if (bind(ctrl->fd, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+		MSG_ERR("Couldn't bind control socket %s: %s\n", path,
+				strerror(errno));
+		return -errno;
+	}
+	/* This can take the flash away from the host, root only */
+	chmod(path, S_IRUSR | S_IWUSR);
+
+	if (listen(ctrl->fd, MBOX_CTRL_MAX_CLIENTS) < 0) {
+		MSG_ERR("Couldn't listen on control socket: %s\n",
+				strerror(errno));
+		return -errno;
+	}
+
+	MSG_OUT("Listening for control connections on %s\n", path);
+
+	return 0;
+}
+
+void ctrl_pollfds(struct mbox_ctrl *ctrl, struct pollfd *fds)
+{
+	int i;
+
+	fds[0].fd = ctrl->fd;
+	fds[0].events = POLLIN;
+	for (i = 0; i < MBOX_CTRL_MAX_CLIENTS; i++) {
+		fds[i + 1].fd = ctrl->clients[i];
+		fds[i + 1].events = POLLIN;
+	}
+
+	/* Let the flash catch up with an update before taking more of it */
+	if (ctrl->update.client >= 0 &&
+			(ctrl->update.outstanding >= MBOX_CTRL_UPDATE_DEPTH ||
+			 ctrl->update.checked == ctrl->update.len))
+		fds[ctrl->update.client + 1].events = 0;
+
+	/* Nothing more from a snapshot's client until it has all of it */
+	if (ctrl->snapshot.client >= 0)
+		fds[ctrl->snapshot.client + 1].events = POLLOUT;
+}
+
+static void ctrl_accept(struct mbox_ctrl *ctrl)
+{
+	int fd, i;
+
+	fd = accept4(ctrl->fd, NULL, NULL, SOCK_CLOEXEC | SOCK_NONBLOCK);
+	if (fd < 0) {
+		MSG_ERR("Couldn't accept control connection: %s\n",
+				strerror(errno));
+		return;
+	}
+
+	for (i = 0; i < MBOX_CTRL_MAX_CLIENTS; i++) {
+		if (ctrl->clients[i] < 0) {
+			MSG_OUT("Control connection %d opened\n", i);
+			ctrl->clients[i] = fd;
+			return;
+		}
+	}
+
+	MSG_ERR("Too many control connections, dropping one\n");
+	close(fd);
+}
+
+static int ctrl_respond(struct mbox_ctrl *ctrl, int i, void *buf,
+		int payload)
+{
+	struct mbox_ctrl_msg *msg = buf;
+
+	msg->len = htole32(payload);
+	if (send(ctrl->clients[i], buf, sizeof(*msg) + payload,
+				MSG_NOSIGNAL) < 0) {
+		MSG_ERR("Couldn't answer control request: %s\n",
+				strerror(errno));
+		return -errno;
+	}
+
+	return 0;
+}
+
+static void update_finish(struct mbox_ctrl *ctrl)
+{
+	struct mbox_ctrl_update *update = &ctrl->update;
+	struct mbox_context *context = update->context, *other;
+	uint32_t erasesize = context->flash->mtd_info.erasesize;
+	char buf[MBOX_CTRL_MSG_MAX];
+	struct mbox_ctrl_msg *msg = (struct mbox_ctrl_msg *)buf;
+	struct mbox_work *work;
+	int i, payload;
+
+	/* Other hosts on the flash pick the new blocks up from the cache */
+	for (i = 0; update->changed && i < ctrl->n; i++) {
+		other = ctrl->contexts[i];
+		if (other == context || other->flash != context->flash ||
+				update->pos >= other->size)
+			continue;
+		work = sched_submit(other, MBOX_SCHED_PREFETCH, 0,
+				mbox_clock_ns(), update->pos,
+				update->len < other->size - update->pos ?
+				update->len : other->size - update->pos);
+		if (work)
+			sched_attribute(work, &ctrl->client);
+	}
+
+	memset(msg, 0, sizeof(*msg));
+	msg->command = update->command;
+	msg->host = context->id;
+	msg->status = update->rc ? MBOX_CTRL_ERR_IO : MBOX_CTRL_OK;
+	payload = snprintf(buf + sizeof(*msg), sizeof(buf) - sizeof(*msg),
+			"Host %u: %s 0x%08x for 0x%08x, "
+			"%lu of %u erase blocks rewritten in %"PRIu64"ms%s%s\n",
+			context->id,
+			update->command == MBOX_CTRL_SNAP_ROLLBACK ?
+			"rolled back" : "updated",
+			update->pos, update->len, update->changed,
+			update->len / erasesize,
+			(mbox_clock_ns() - update->start) / 1000000,
+			update->rc ? ": " : "",
+			update->rc ? strerror(-update->rc) : "");
+	MSG_OUT("%s", buf + sizeof(*msg));
+	if (update->client >= 0)
+		ctrl_respond(ctrl, update->client, buf, payload);
+
+	free(update->buf);
+	memset(update, 0, sizeof(*update));
+	update->client = -1;
+}
+
+/* Done once the whole image is in and the last of it on flash */
+static void update_check(struct mbox_ctrl *ctrl)
+{
+	struct mbox_ctrl_update *update = &ctrl->update;
+
+	if (update->context && update->checked == update->len &&
+			!update->outstanding)
+		update_finish(ctrl);
+}
+
+static void update_done(struct mbox_context *context, struct mbox_work *work,
+		void *priv)
+{
+	struct mbox_ctrl *ctrl = priv;
+
+	ctrl->update.outstanding--;
+	if (work->rc && !ctrl->update.rc)
+		ctrl->update.rc = work->rc;
+	update_check(ctrl);
+}
+
+/*
+ * The new content of the erase block at 'pos' is in the host's window,
+ * queue writing it out if it differs from the flash.
+ */
+static void update_block(struct mbox_ctrl *ctrl, uint32_t pos)
+{
+	struct mbox_ctrl_update *update = &ctrl->update;
+	struct mbox_context *context = update->context;
+	uint32_t erasesize = context->flash->mtd_info.erasesize;
+	struct mbox_flash *flash = context->flash;
+	uint32_t crc, old;
+	struct mbox_work *work;
+
+	/* The overlay is what the host sees there, it's at hand */
+	if (flash_overlay_has(flash, pos)) {
+		if (!memcmp(context->lpc_mem + pos, flash->overlay + pos,
+					erasesize))
+			return;
+	} else {
+		crc = mbox_crc32c(0, context->lpc_mem + pos, erasesize);
+		if (!scan_index_lookup(flash, pos, &old)) {
+			/* Compare with whatever the read returned */
+			if (flash_read_buf(context, update->buf, pos,
+						erasesize))
+				old = ~crc;
+			else
+				old = mbox_crc32c(0, update->buf, erasesize);
+		}
+		if (old == crc)
+			return;
+	}
+
+	work = sched_submit(context, MBOX_SCHED_FLUSH, 0, mbox_clock_ns(), pos,
+			erasesize);
+	if (!work) {
+		if (!update->rc)
+			update->rc = -ENOMEM;
+		return;
+	}
+	sched_attribute(work, &ctrl->client);
+	sched_on_complete(work, update_done, ctrl);
+	update->outstanding++;
+	update->changed++;
+}
+
+/* Put back what the flash has for whatever of the image didn't make it */
+static void update_abort(struct mbox_ctrl *ctrl, int rc)
+{
+	struct mbox_ctrl_update *update = &ctrl->update;
+	struct mbox_work *work;
+
+	MSG_ERR("Update of host %u abandoned at 0x%08x, the flash is only partly updated\n",
+			update->context->id, update->pos + update->checked);
+	if (!update->rc)
+		update->rc = rc;
+
+	work = sched_submit(update->context, MBOX_SCHED_PREFETCH, 0,
+			mbox_clock_ns(), update->pos + update->checked,
+			update->len - update->checked);
+	if (work)
+		sched_attribute(work, &ctrl->client);
+	update->received = update->checked = update->len;
+	update_check(ctrl);
+}
+
+/* Writing to the flash behind a host is only allowed while it's suspended */
+static int update_begin(struct mbox_ctrl *ctrl, int i, uint8_t command,
+		struct mbox_context *context, uint32_t pos, uint32_t len)
+{
+	struct mbox_ctrl_update *update = &ctrl->update;
+	uint32_t erasesize = context->flash->mtd_info.erasesize;
+
+	if (update->context || !context->suspended) {
+		MSG_ERR("Host %u must be suspended, one update at a time\n",
+				context->id);
+		return MBOX_CTRL_ERR_STATE;
+	}
+
+	if (!len || (pos | len) & (erasesize - 1) || pos >= context->size ||
+			len > context->size - pos) {
+		MSG_ERR("Update of 0x%08x for 0x%08x isn't erase block aligned or doesn't fit\n",
+				pos, len);
+		return MBOX_CTRL_ERR_PARAM;
+	}
+
+	memset(update, 0, sizeof(*update));
+	update->buf = malloc(erasesize);
+	if (!update->buf) {
+		update->client = -1;
+		return MBOX_CTRL_ERR_IO;
+	}
+	update->command = command;
+	update->client = i;
+	update->context = context;
+	update->pos = pos;
+	update->len = len;
+	update->start = mbox_clock_ns();
+
+	return MBOX_CTRL_OK;
+}
+
+static int update_start(struct mbox_ctrl *ctrl, int i,
+		struct mbox_ctrl_msg *req)
+{
+	uint32_t pos = le32toh(req->offset), len = le32toh(req->len);
+	int status;
+
+	if (req->host >= ctrl->n)
+		return MBOX_CTRL_ERR_PARAM;
+
+	status = update_begin(ctrl, i, MBOX_CTRL_UPDATE,
+			ctrl->contexts[req->host], pos, len);
+	if (status == MBOX_CTRL_OK)
+		MSG_OUT("Host %u: receiving an update of 0x%08x for 0x%08x\n",
+				req->host, pos, len);
+
+	return status;
+}
+
+/*
+ * Put back every block that changed since the snapshot, the same way an
+ * update would: through the window, skipping any that match the flash.
+ */
+static int snap_rollback(struct mbox_ctrl *ctrl, int i,
+		struct mbox_ctrl_msg *req)
+{
+	struct mbox_ctrl_update *update = &ctrl->update;
+	struct mbox_context *context;
+	struct mbox_flash_snap *snap;
+	uint32_t erasesize, blocks, blk, pos;
+	int status, rc;
+
+	if (req->host >= ctrl->n)
+		return MBOX_CTRL_ERR_PARAM;
+
+	context = ctrl->contexts[req->host];
+	if (!context->flash->snap) {
+		MSG_ERR("Host %u has no snapshot to roll back to\n",
+				context->id);
+		return MBOX_CTRL_ERR_STATE;
+	}
+
+	status = update_begin(ctrl, i, MBOX_CTRL_SNAP_ROLLBACK, context, 0,
+			context->size);
+	if (status != MBOX_CTRL_OK)
+		return status;
+
+	/* Writing it back mustn't save anything into it */
+	snap = flash_snap_detach(context->flash);
+	MSG_OUT("Host %u: rolling back %u erase blocks\n", context->id,
+			snap->saved);
+
+	erasesize = context->flash->mtd_info.erasesize;
+	blocks = context->flash->mtd_info.size / erasesize;
+	for (blk = 0; blk < blocks; blk++) {
+		if (!snap->blocks[blk])
+			continue;
+
+		pos = blk * erasesize;
+		if (pos < context->size) {
+			memcpy(context->lpc_mem + pos, snap->blocks[blk],
+					erasesize);
+			update_block(ctrl, pos);
+			continue;
+		}
+
+		/* Only another host's window reaches this far */
+		if (flash_overlaid(context->flash, pos)) {
+			rc = flash_overlay_write_buf(context,
+					snap->blocks[blk], pos, erasesize);
+		} else {
+			rc = flash_erase(context, pos, erasesize);
+			if (!rc)
+				rc = flash_program_buf(context,
+						snap->blocks[blk], pos,
+						erasesize);
+		}
+		if (rc && !update->rc)
+			update->rc = rc;
+	}
+	update->received = update->checked = update->len;
+	flash_snap_free(context->flash, snap);
+
+	return MBOX_CTRL_OK;
+}
+
+/* Worst case PackBits output for a chunk */
+#define PACKBITS_MAX(_n) ((_n) + ((_n) + 127) / 128)
+
+/*
+ * PackBits: a header byte n then n + 1 literal bytes for n in [0, 127], or
+ * one byte to repeat 1 - n times for n in [-127, -1]. Erased flash, which
+ * is most of a typical PNOR, shrinks by a factor of 64.
+ */
+static size_t packbits(uint8_t *out, const uint8_t *in, size_t len)
+{
+	size_t i = 0, o = 0, run, lit;
+
+	while (i < len) {
+		for (run = 1; i + run < len && run < 128 &&
+				in[i + run] == in[i]; run++)
+			;
+		if (run > 1) {
+			out[o++] = (uint8_t)(1 - run);
+			out[o++] = in[i];
+			i += run;
+			continue;
+		}
+
+		/* Literals up to the next run of three or more */
+		for (lit = 1; i + lit < len && lit < 128; lit++) {
+			if (i + lit + 2 < len && in[i + lit] == in[i + lit + 1] &&
+					in[i + lit] == in[i + lit + 2])
+				break;
+		}
+		out[o++] = lit - 1;
+		memcpy(out + o, in + i, lit);
+		o += lit;
+		i += lit;
+	}
+
+	return o;
+}
+
+static void snapshot_end(struct mbox_ctrl *ctrl)
+{
+	struct mbox_ctrl_snapshot *snapshot = &ctrl->snapshot;
+
+	if (snapshot->sent == snapshot->len)
+		MSG_OUT("Snapshot of 0x%08x bytes sent as %llu in %"PRIu64"ms\n",
+				snapshot->len, snapshot->bytes,
+				(mbox_clock_ns() - snapshot->start) / 1000000);
+	else
+		MSG_ERR("Snapshot abandoned after 0x%08x bytes\n",
+				snapshot->sent);
+
+	free(snapshot->buf);
+	free(snapshot->out);
+	memset(snapshot, 0, sizeof(*snapshot));
+	snapshot->client = -1;
+}
+
+/*
+ * The window is the flash plus whatever the host wrote that isn't on it
+ * yet, so it's all there without going near the SPI. It's copied up front
+ * so that neither the host nor an update can change it under the client.
+ */
+static int snapshot_start(struct mbox_ctrl *ctrl, int i,
+		struct mbox_ctrl_msg *req)
+{
+	struct mbox_ctrl_snapshot *snapshot = &ctrl->snapshot;
+	uint32_t pos = le32toh(req->offset), len = le32toh(req->len);
+	struct mbox_context *context;
+
+	if (req->host >= ctrl->n)
+		return MBOX_CTRL_ERR_PARAM;
+
+	if (snapshot->client >= 0) {
+		MSG_ERR("A snapshot is already in progress\n");
+		return MBOX_CTRL_ERR_STATE;
+	}
+
+	context = ctrl->contexts[req->host];
+	if (!len || pos >= context->size || len > context->size - pos) {
+		MSG_ERR("Snapshot of 0x%08x for 0x%08x is outside the window\n",
+				pos, len);
+		return MBOX_CTRL_ERR_PARAM;
+	}
+
+	snapshot->buf = malloc(len);
+	snapshot->out = malloc(PACKBITS_MAX(MBOX_CTRL_CHUNK));
+	if (!snapshot->buf || !snapshot->out) {
+		MSG_ERR("Couldn't allocate a snapshot of 0x%08x bytes\n", len);
+		free(snapshot->buf);
+		free(snapshot->out);
+		snapshot->buf = snapshot->out = NULL;
+		return MBOX_CTRL_ERR_IO;
+	}
+	memcpy(snapshot->buf, context->lpc_mem + pos, len);
+
+	snapshot->client = i;
+	snapshot->flags = req->flags;
+	snapshot->len = len;
+	snapshot->sent = 0;
+	snapshot->bytes = 0;
+	snapshot->start = mbox_clock_ns();
+
+	MSG_OUT("Host %u: snapshot of 0x%08x for 0x%08x%s\n", context->id,
+			pos, len, req->flags & MBOX_CTRL_F_COMPRESS ?
+			", compressed" : "");
+
+	return MBOX_CTRL_OK;
+}
+
+/* Send as much as the socket will take */
+static int snapshot_send(struct mbox_ctrl *ctrl)
+{
+	struct mbox_ctrl_snapshot *snapshot = &ctrl->snapshot;
+	const uint8_t *data;
+	uint32_t n;
+	size_t len;
+
+	while (snapshot->sent < snapshot->len) {
+		n = snapshot->len - snapshot->sent;
+		if (n > MBOX_CTRL_CHUNK)
+			n = MBOX_CTRL_CHUNK;
+
+		data = snapshot->buf + snapshot->sent;
+		len = n;
+		if (snapshot->flags & MBOX_CTRL_F_COMPRESS) {
+			len = packbits(snapshot->out, data, n);
+			data = snapshot->out;
+		}
+
+		if (send(ctrl->clients[snapshot->client], data, len,
+					MSG_NOSIGNAL) < 0) {
+			if (errno == EAGAIN)
+				return 0;
+			MSG_ERR("Couldn't send snapshot: %s\n", strerror(errno));
+			return -errno;
+		}
+		snapshot->sent += n;
+		snapshot->bytes += len;
+	}
+
+	snapshot_end(ctrl);
+
+	return 0;
+}
+
+static void ctrl_close(struct mbox_ctrl *ctrl, int i)
+{
+	if (ctrl->snapshot.client == i)
+		snapshot_end(ctrl);
+
+	if (ctrl->update.client == i) {
+		ctrl->update.client = -1;
+		if (ctrl->update.checked < ctrl->update.len)
+			update_abort(ctrl, -EPIPE);
+	}
+
+	/* The work goes on, there's just no one to tell */
+	if (ctrl->wait.client == i)
+		ctrl->wait.client = -1;
+
+	MSG_OUT("Control connection %d closed\n", i);
+	close(ctrl->clients[i]);
+	ctrl->clients[i] = -1;
+}
+
+/* Hosts addressed by 'host' as [*first, *last) */
+static int ctrl_hosts(struct mbox_ctrl *ctrl, uint8_t host, int *first,
+		int *last)
+{
+	if (host == MBOX_CTRL_ALL_HOSTS) {
+		*first = 0;
+		*last = ctrl->n;
+		return 0;
+	}
+
+	if (host >= ctrl->n)
+		return -EINVAL;
+
+	*first = host;
+	*last = host + 1;
+
+	return 0;
+}
+
+static uint8_t ctrl_status(int rc)
+{
+	switch (rc) {
+		case -EINVAL:
+			return MBOX_CTRL_ERR_PARAM;
+		case -EBUSY:
+			return MBOX_CTRL_ERR_STATE;
+		default:
+			return MBOX_CTRL_ERR_IO;
+	}
+}
+
+static void ctrl_wait_start(struct mbox_ctrl *ctrl, int client)
+{
+	struct mbox_ctrl_wait *wait = &ctrl->wait;
+
+	wait->client = client;
+	wait->busy = true;
+	wait->outstanding = 1;
+	wait->rc = 0;
+}
+
+/* One less thing to wait for, answer once there's nothing left */
+static void ctrl_wait_done(struct mbox_ctrl *ctrl, int rc)
+{
+	struct mbox_ctrl_wait *wait = &ctrl->wait;
+
+	if (rc && !wait->rc)
+		wait->rc = rc;
+	if (--wait->outstanding)
+		return;
+
+	if (wait->rc && wait->msg.status == MBOX_CTRL_OK)
+		wait->msg.status = ctrl_status(wait->rc);
+	wait->busy = false;
+	if (wait->client >= 0 && ctrl_respond(ctrl, wait->client, &wait->msg,
+				0))
+		ctrl_close(ctrl, wait->client);
+	wait->client = -1;
+}
+
+static void ctrl_suspended(struct mbox_context *context, int rc, void *priv)
+{
+	context->draining = false;
+	if (rc) {
+		MSG_ERR("Host %u: couldn't write back before suspending: %s\n",
+				context->id, strerror(-rc));
+	} else {
+		MSG_OUT("Host %u suspended\n", context->id);
+		context->suspended = true;
+		notify_state(context, MBOX_BMC_EVT_SUSPENDED, true);
+	}
+
+	ctrl_wait_done(priv, rc);
+}
+
+/* Write back the host's dirty data and keep it off the flash until resumed */
+static int ctrl_suspend(struct mbox_ctrl *ctrl, struct mbox_context *context)
+{
+	if (context->suspended)
+		return 0;
+
+	ctrl->wait.outstanding++;
+	if (sched_on_drain(context, MBOX_SCHED_FLUSH, ctrl_suspended, ctrl)) {
+		/* Or it could keep the flush going forever */
+		context->draining = true;
+		return 0;
+	}
+	ctrl_suspended(context, 0, ctrl);
+
+	return 0;
+}
+
+static void ctrl_flushed(struct mbox_context *context, int rc, void *priv)
+{
+	ctrl_wait_done(priv, rc);
+}
+
+/* Answered once everything the host has queued so far is on flash */
+static int ctrl_flush(struct mbox_ctrl *ctrl, struct mbox_context *context)
+{
+	if (sched_on_drain(context, MBOX_SCHED_FLUSH, ctrl_flushed, ctrl))
+		ctrl->wait.outstanding++;
+
+	return 0;
+}
+
+static int ctrl_resume(struct mbox_ctrl *ctrl, struct mbox_context *context)
+{
+	if (!context->suspended)
+		return 0;
+
+	if (ctrl->update.context == context) {
+		MSG_ERR("Host %u has an update in progress\n", context->id);
+		return -EBUSY;
+	}
+
+	MSG_OUT("Host %u resumed\n", context->id);
+	context->suspended = false;
+	notify_state(context, MBOX_BMC_EVT_SUSPENDED, false);
+
+	return 0;
+}
+
+/*
+ * Something else wrote the flash. Forget what we cached of it and reload
+ * the host's copy, other than blocks it has written and not flushed yet.
+ */
+static int ctrl_invalidate(struct mbox_ctrl *ctrl,
+		struct mbox_context *context, uint32_t pos, uint32_t len)
+{
+	struct mbox_work *work;
+
+	if (pos >= context->flash->mtd_info.size ||
+			len > context->flash->mtd_info.size - pos)
+		return -EINVAL;
+
+	flash_cache_invalidate(context->flash, pos, len);
+
+	if (pos >= context->size)
+		return 0;
+	if (len > context->size - pos)
+		len = context->size - pos;
+
+	MSG_OUT("Host %u: reloading 0x%08x for 0x%08x\n", context->id, pos, len);
+	work = sched_submit(context, MBOX_SCHED_PREFETCH, 0, mbox_clock_ns(),
+			pos, len);
+	if (!work)
+		return -ENOMEM;
+	sched_attribute(work, &ctrl->client);
+
+	return sched_wait(context, work, false) == MBOX_R_SUCCESS ? 0 : -EIO;
+}
+
+static void ctrl_flattened(struct mbox_context *context,
+		struct mbox_work *work, void *priv)
+{
+	ctrl_wait_done(priv, work->rc ? -EIO : 0);
+}
+
+/* Move the overlay of the flash behind 'host' onto the SPI */
+static int ctrl_flatten(struct mbox_ctrl *ctrl, int first, int host)
+{
+	struct mbox_context *context = ctrl->contexts[host];
+	struct mbox_flash *flash = context->flash;
+	uint32_t erasesize = flash->mtd_info.erasesize;
+	struct mbox_range *ranges;
+	struct mbox_work *work;
+	uint32_t pos;
+	int i, n = 0;
+
+	/* Hosts sharing a flash share its overlay, once is enough */
+	for (i = first; i < host; i++) {
+		if (ctrl->contexts[i]->flash == flash)
+			return 0;
+	}
+
+	if (!flash->overlay_blocks)
+		return 0;
+
+	ranges = calloc(flash->overlay_blocks, sizeof(*ranges));
+	if (!ranges)
+		return -ENOMEM;
+
+	for (pos = 0; pos < flash->mtd_info.size; pos += erasesize) {
+		if (!flash_overlay_has(flash, pos))
+			continue;
+		if (n && ranges[n - 1].pos + ranges[n - 1].len == pos) {
+			ranges[n - 1].len += erasesize;
+			continue;
+		}
+		ranges[n].pos = pos;
+		ranges[n].len = erasesize;
+		n++;
+	}
+
+	MSG_OUT("Host %u: flattening %u overlay erase blocks in %d ranges\n",
+			context->id, flash->overlay_blocks, n);
+	work = sched_submit_ranges(context, MBOX_SCHED_FLUSH, 0,
+			mbox_clock_ns(), ranges, n);
+	free(ranges);
+	if (!work)
+		return -ENOMEM;
+	work->flatten = true;
+	sched_attribute(work, &ctrl->client);
+	sched_on_complete(work, ctrl_flattened, ctrl);
+	ctrl->wait.outstanding++;
+
+	return 0;
+}
+
+/* Check the flash behind 'host' against its block index */
+static int ctrl_scan(struct mbox_ctrl *ctrl, int first, int host)
+{
+	struct mbox_context *context = ctrl->contexts[host];
+	int i;
+
+	/* Hosts sharing a flash share its index, once is enough */
+	for (i = first; i < host; i++) {
+		if (ctrl->contexts[i]->flash == context->flash)
+			return 0;
+	}
+
+	return scan_start(context, &ctrl->client);
+}
+
+/* The host queued 'work', if any */
+static struct mbox_context *ctrl_owner(struct mbox_ctrl *ctrl,
+		struct mbox_work *work)
+{
+	struct mbox_work *w;
+	int i;
+
+	for (i = 0; i < ctrl->n; i++) {
+		for (w = ctrl->contexts[i]->work[work->cls]; w; w = w->next) {
+			if (w == work)
+				return ctrl->contexts[i];
+		}
+	}
+
+	return NULL;
+}
+
+/* Move every host on 'flash' over to its secondary, now the primary */
+static int ctrl_switch_swap(struct mbox_ctrl *ctrl, struct mbox_flash *flash)
+{
+	struct mbox_context *owner = NULL;
+	struct mbox_client *client = NULL;
+	struct mbox_flash *next;
+	int i;
+
+	next = flash_mirror_switch(flash);
+	if (!next) {
+		MSG_ERR("Can't switch away from %s, it's out of sync "
+				"or has an overlay or snapshot\n", flash->path);
+		return -EBUSY;
+	}
+
+	/* A scan runs on whatever its host's flash is, start it over on this */
+	if (flash->scan_work)
+		owner = ctrl_owner(ctrl, flash->scan_work);
+	if (owner) {
+		if (flash->scan_work->client != &flash->scan_client)
+			client = flash->scan_work->client;
+		sched_cancel(owner, flash->scan_work);
+	}
+
+	for (i = 0; i < ctrl->n; i++) {
+		if (ctrl->contexts[i]->flash == flash)
+			ctrl->contexts[i]->flash = next;
+	}
+
+	if (owner)
+		scan_start(owner, client);
+
+	return 0;
+}
+
+static void ctrl_switch_end(struct mbox_ctrl *ctrl, struct mbox_flash *flash,
+		int rc)
+{
+	int i;
+
+	for (i = 0; i < ctrl->n; i++) {
+		if (ctrl->contexts[i]->flash == flash ||
+				ctrl->contexts[i]->flash == flash->mirror)
+			ctrl->contexts[i]->draining = false;
+	}
+
+	ctrl_wait_done(ctrl, rc);
+}
+
+static void ctrl_switch_mirrored(struct mbox_context *context, int rc,
+		void *priv)
+{
+	struct mbox_flash *flash = context->flash;
+
+	ctrl_switch_end(priv, flash, rc ? rc : ctrl_switch_swap(priv, flash));
+}
+
+static void ctrl_switch_flushed(struct mbox_context *context, int rc,
+		void *priv);
+
+/*
+ * Finish the writes queued for 'flash', then bring the secondary up to
+ * date, then swap. Each waits for the hosts' queues to drain and comes
+ * back here through the callbacks.
+ */
+static void ctrl_switch_step(struct mbox_ctrl *ctrl, struct mbox_flash *flash)
+{
+	struct mbox_context *context;
+	int i;
+
+	for (i = 0; i < ctrl->n; i++) {
+		context = ctrl->contexts[i];
+		if (context->flash == flash && sched_on_drain(context,
+					MBOX_SCHED_FLUSH, ctrl_switch_flushed,
+					ctrl))
+			return;
+	}
+
+	for (i = 0; i < ctrl->n; i++) {
+		context = ctrl->contexts[i];
+		if (context->flash != flash)
+			continue;
+		sched_mirror(context);
+		if (sched_on_drain(context, MBOX_SCHED_MIRROR,
+					ctrl_switch_mirrored, ctrl))
+			return;
+	}
+
+	ctrl_switch_end(ctrl, flash, ctrl_switch_swap(ctrl, flash));
+}
+
+static void ctrl_switch_flushed(struct mbox_context *context, int rc,
+		void *priv)
+{
+	if (rc)
+		ctrl_switch_end(priv, context->flash, rc);
+	else
+		ctrl_switch_step(priv, context->flash);
+}
+
+/* Swap the primary and secondary chip behind 'host' */
+static int ctrl_switch(struct mbox_ctrl *ctrl, int first, int host)
+{
+	struct mbox_flash *flash = ctrl->contexts[host]->flash;
+	int i;
+
+	for (i = first; i < host; i++) {
+		if (ctrl->contexts[i]->flash == flash)
+			return 0;
+	}
+
+	if (!flash->mirror) {
+		MSG_ERR("Host %u has no secondary flash\n",
+				ctrl->contexts[host]->id);
+		return -EINVAL;
+	}
+
+	/* No point catching up only to be refused */
+	if (flash->overlay_blocks || flash->snap) {
+		MSG_ERR("Can't switch away from %s, it has an overlay or snapshot\n",
+				flash->path);
+		return -EBUSY;
+	}
+
+	/* Or the hosts could keep both queues going forever */
+	for (i = 0; i < ctrl->n; i++) {
+		if (ctrl->contexts[i]->flash == flash)
+			ctrl->contexts[i]->draining = true;
+	}
+
+	ctrl->wait.outstanding++;
+	ctrl_switch_step(ctrl, flash);
+
+	return 0;
+}
+
+static int ctrl_stats(struct mbox_ctrl *ctrl, char *buf, size_t size)
+{
+	struct mbox_context *context;
+	size_t len = 0;
+	int i;
+
+	for (i = 0; i < ctrl->n && len < size; i++) {
+		context = ctrl->contexts[i];
+		len += snprintf(buf + len, size - len,
+				"Host %u: %s, %lu commands, "
+				"%lu register syscalls, max %u per command\n",
+				context->id,
+				context->suspended ? "suspended" : "running",
+				context->regs_stats.commands,
+				context->regs_stats.total_syscalls,
+				context->regs_stats.max_syscalls);
+		if (len >= size)
+			break;
+		len += snprintf(buf + len, size - len,
+				"Host %u: %lu events, %lu notifications, "
+				"%lu piggybacked, %lu suppressed\n",
+				context->id,
+				context->notify_stats.events,
+				context->notify_stats.sent,
+				context->notify_stats.piggybacked,
+				context->notify_stats.suppressed);
+		if (len >= size)
+			break;
+		if (context->flash->crc) {
+			len += snprintf(buf + len, size - len,
+					"Host %u: %lu scans%s, "
+					"%lu erase blocks scanned, "
+					"%lu changed behind our back, "
+					"last scan %"PRIu64"ms\n",
+					context->id,
+					context->flash->scan_stats.scans,
+					context->flash->scan_work ?
+					" (one running)" : "",
+					context->flash->scan_stats.blocks,
+					context->flash->scan_stats.drifted,
+					context->flash->scan_stats.last_ns / 1000000);
+			if (len >= size)
+				break;
+		}
+		if (context->ecc) {
+			len += snprintf(buf + len, size - len,
+					"Host %u: %llu ECC words checked, "
+					"%lu corrected, %lu uncorrectable\n",
+					context->id,
+					context->ecc_stats.words,
+					context->ecc_stats.corrected,
+					context->ecc_stats.uncorrectable);
+			if (len >= size)
+				break;
+		}
+		if (context->verify) {
+			len += snprintf(buf + len, size - len,
+					"Host %u: %lu erase blocks verified, "
+					"%lu pages programmed again, "
+					"%lu blocks erased again, %lu failed\n",
+					context->id,
+					context->verify_stats.blocks,
+					context->verify_stats.reprogrammed,
+					context->verify_stats.reerased,
+					context->verify_stats.failed);
+			if (len >= size)
+				break;
+		}
+		len += sched_client_print(&context->client, buf + len,
+				size - len);
+		if (len < size && context->scrub_rate) {
+			len += snprintf(buf + len, size - len,
+					"Host %u: scrubbed %lu erase blocks, "
+					"%lu full passes, %lu refreshed, "
+					"%lu read errors\n",
+					context->id,
+					context->scrub_stats.blocks,
+					context->scrub_stats.passes,
+					context->scrub_stats.refreshed,
+					context->scrub_stats.errors);
+			if (len < size)
+				len += sched_client_print(
+						&context->scrub_client,
+						buf + len, size - len);
+		}
+		if (len >= size || !context->flash->mirror)
+			continue;
+		len += snprintf(buf + len, size - len,
+				"Host %u: %s mirrored to %s, %lu erase blocks rewritten\n",
+				context->id, context->flash->path,
+				context->flash->mirror->path,
+				context->flash->mirror_writes);
+		if (len < size)
+			len += sched_client_print(&context->flash->mirror_client,
+					buf + len, size - len);
+	}
+	if (len < size)
+		len += sched_client_print(&ctrl->client, buf + len, size - len);
+
+	/* Truncated, but still something */
+	return len < size ? len : size - 1;
+}
+
+static int ctrl_wear(struct mbox_ctrl *ctrl, char *buf, size_t size)
+{
+	struct mbox_flash *flash;
+	size_t len = 0;
+	int i, j;
+
+	for (i = 0; i < ctrl->n && len < size; i++) {
+		flash = ctrl->contexts[i]->flash;
+		/* Once per flash, however many hosts share it */
+		for (j = 0; j < i; j++) {
+			if (ctrl->contexts[j]->flash == flash)
+				break;
+		}
+		if (j < i)
+			continue;
+		len += wear_report(flash, buf + len, size - len);
+		if (len < size && flash->mirror)
+			len += wear_report(flash->mirror, buf + len,
+					size - len);
+	}
+
+	/* Truncated, but still something */
+	return len < size ? len : size - 1;
+}
+
+static int ctrl_command(struct mbox_ctrl *ctrl, int client,
+		struct mbox_ctrl_msg *req, char *payload, size_t size)
+{
+	struct mbox_context *context;
+	int first, last, i, rc;
+
+	if (ctrl->wait.busy && req->command != MBOX_CTRL_STATS &&
+			req->command != MBOX_CTRL_WEAR) {
+		MSG_ERR("Control command 0x%02x while another is in progress\n",
+				req->command);
+		req->status = MBOX_CTRL_ERR_STATE;
+		return 0;
+	}
+
+	/* Addresses a single host, and the rest of it follows as data */
+	if (req->command == MBOX_CTRL_UPDATE) {
+		req->status = update_start(ctrl, client, req);
+		return 0;
+	}
+	if (req->command == MBOX_CTRL_SNAPSHOT) {
+		req->status = snapshot_start(ctrl, client, req);
+		return 0;
+	}
+	if (req->command == MBOX_CTRL_SNAP_ROLLBACK) {
+		req->status = snap_rollback(ctrl, client, req);
+		return 0;
+	}
+
+	if (ctrl_hosts(ctrl, req->host, &first, &last)) {
+		MSG_ERR("Control request for unknown host %u\n", req->host);
+		req->status = MBOX_CTRL_ERR_PARAM;
+		return 0;
+	}
+
+	switch (req->command) {
+		case MBOX_CTRL_SUSPEND:
+		case MBOX_CTRL_FLUSH:
+		case MBOX_CTRL_FLATTEN:
+		case MBOX_CTRL_SWITCH:
+			ctrl_wait_start(ctrl, client);
+			break;
+	}
+
+	req->status = MBOX_CTRL_OK;
+	for (i = first; i < last; i++) {
+		context = ctrl->contexts[i];
+		switch (req->command) {
+			case MBOX_CTRL_SUSPEND:
+				rc = ctrl_suspend(ctrl, context);
+				break;
+			case MBOX_CTRL_RESUME:
+				rc = ctrl_resume(ctrl, context);
+				break;
+			case MBOX_CTRL_FLUSH:
+				rc = ctrl_flush(ctrl, context);
+				break;
+			case MBOX_CTRL_SNAP_CREATE:
+				rc = flash_snap_create(context->flash);
+				break;
+			case MBOX_CTRL_SNAP_DROP:
+				flash_snap_free(context->flash,
+						flash_snap_detach(context->flash));
+				rc = 0;
+				break;
+			case MBOX_CTRL_FLATTEN:
+				rc = ctrl_flatten(ctrl, first, i);
+				break;
+			case MBOX_CTRL_SWITCH:
+				rc = ctrl_switch(ctrl, first, i);
+				break;
+			case MBOX_CTRL_SCAN:
+				rc = ctrl_scan(ctrl, first, i);
+				break;
+			case MBOX_CTRL_INVALIDATE:
+				rc = ctrl_invalidate(ctrl, context,
+						le32toh(req->offset),
+						le32toh(req->len));
+				break;
+			case MBOX_CTRL_STATS:
+				/* Covers every host at once */
+				return ctrl_stats(ctrl, payload, size);
+			case MBOX_CTRL_WEAR:
+				/* Likewise every flash */
+				return ctrl_wear(ctrl, payload, size);
+			default:
+				MSG_ERR("Unknown control command 0x%02x\n",
+						req->command);
+				req->status = MBOX_CTRL_ERR_UNKNOWN;
+				return 0;
+		}
+
+		if (rc && req->status == MBOX_CTRL_OK)
+			req->status = ctrl_status(rc);
+	}
+
+	if (!ctrl->wait.busy)
+		return 0;
+
+	/* Answered once the last of the work is done, maybe right now */
+	ctrl->wait.msg = *req;
+	ctrl_wait_done(ctrl, 0);
+
+	return -1;
+}
+
+/* Image data goes straight into the host's window */
+static void update_recv(struct mbox_ctrl *ctrl, int i)
+{
+	struct mbox_ctrl_update *update = &ctrl->update;
+	uint32_t erasesize = update->context->flash->mtd_info.erasesize;
+	uint32_t space = update->len - update->received;
+	ssize_t len;
+
+	len = recv(ctrl->clients[i], update->context->lpc_mem + update->pos +
+			update->received, space, MSG_TRUNC);
+	if (len <= 0) {
+		if (len == 0 || errno != EAGAIN)
+			ctrl_close(ctrl, i);
+		return;
+	}
+	if (len > space) {
+		MSG_ERR("Update data runs past the end of the image\n");
+		update_abort(ctrl, -EINVAL);
+		return;
+	}
+
+	update->received += len;
+	while (update->checked + erasesize <= update->received) {
+		update_block(ctrl, update->pos + update->checked);
+		update->checked += erasesize;
+	}
+	update_check(ctrl);
+}
+
+static void ctrl_handle(struct mbox_ctrl *ctrl, int i)
+{
+	char buf[MBOX_CTRL_MSG_MAX];
+	struct mbox_ctrl_msg *msg = (struct mbox_ctrl_msg *)buf;
+	ssize_t len;
+	int payload;
+
+	if (ctrl->update.client == i) {
+		update_recv(ctrl, i);
+		return;
+	}
+
+	len = recv(ctrl->clients[i], msg, sizeof(*msg), 0);
+	if (len <= 0) {
+		if (len == 0 || errno != EAGAIN)
+			ctrl_close(ctrl, i);
+		return;
+	}
+
+	MSG_OUT("Control command 0x%02x for host %u\n", msg->command,
+			msg->host);
+	if (len != sizeof(*msg)) {
+		MSG_ERR("Short control request, %zd bytes\n", len);
+		msg->status = MBOX_CTRL_ERR_PARAM;
+		payload = 0;
+	} else {
+		payload = ctrl_command(ctrl, i, msg, buf + sizeof(*msg),
+				sizeof(buf) - sizeof(*msg));
+	}
+
+	/* Or it's answered later */
+	if (payload >= 0 && ctrl_respond(ctrl, i, buf, payload))
+		ctrl_close(ctrl, i);
+
+	/* A rollback may have had nothing to write, it answers again */
+	update_check(ctrl);
+}
+
+void ctrl_dispatch(struct mbox_ctrl *ctrl, struct pollfd *fds)
+{
+	int i;
+
+	for (i = 0; i < MBOX_CTRL_MAX_CLIENTS; i++) {
+		if (ctrl->clients[i] < 0)
+			continue;
+		if (ctrl->snapshot.client == i &&
+				(fds[i + 1].revents & POLLOUT)) {
+			if (snapshot_send(ctrl))
+				ctrl_close(ctrl, i);
+		} else if (fds[i + 1].revents & POLLIN)
+			ctrl_handle(ctrl, i);
+		else if (fds[i + 1].revents & (POLLHUP | POLLERR))
+			ctrl_close(ctrl, i);
+	}
+
+	if (fds[0].revents & POLLIN)
+		ctrl_accept(ctrl);
+}
+
+void ctrl_free(struct mbox_ctrl *ctrl)
+{
+	int i;
+
+	if (ctrl->fd >= 0) {
+		for (i = 0; i < MBOX_CTRL_MAX_CLIENTS; i++) {
+			if (ctrl->clients[i] >= 0)
+				close(ctrl->clients[i]);
+			ctrl->clients[i] = -1;
+		}
+		sched_client_dump(&ctrl->client);
+		close(ctrl->fd);
+		unlink(ctrl->path);
+	}
+	ctrl->fd = -1;
+
+	free(ctrl->update.buf);
+	ctrl->update.buf = NULL;
+	free(ctrl->snapshot.buf);
+	free(ctrl->snapshot.out);
+	ctrl->snapshot.buf = ctrl->snapshot.out = NULL;
+	free(ctrl->path);
+	ctrl->path = NULL;
+}
@@ -0,0 +1,196 @@
+/* Copyright 2016 IBM
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *    http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *	Unless required by applicable law or agreed to in writing, software
+ *	distributed under the License is distributed on an "AS IS" BASIS,
+ *	WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *	See the License for the specific language governing permissions and
+ *	limitations under the License.
+ *
+ */
+
+#ifndef MBOXD_CTRL_H
+#define MBOXD_CTRL_H
+
+#include <poll.h>
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "mboxd_sched.h"
+
+/*
+ * BMC side control of mboxd over a SOCK_SEQPACKET unix socket. Each
+ * request is one struct mbox_ctrl_msg, each response one struct
+ * mbox_ctrl_msg with 'status' filled in, followed by 'len' bytes of
+ * payload for commands that return data. All fields are little endian.
+ *
+ * Commands that wait on the flash are answered once it's done, the daemon
+ * keeps serving the hosts meanwhile. Until then anything but STATS and WEAR
+ * is refused with MBOX_CTRL_ERR_STATE.
+ */
+
+#define MBOX_CTRL_PATH "/run/mboxd.sock"
+
+/* Stop touching the flash for the host(s), after writing back dirty data */
+#define MBOX_CTRL_SUSPEND 0x01
+/* Let the host(s) at the flash again */
+#define MBOX_CTRL_RESUME 0x02
+/* Write back everything outstanding, respond once it's on flash */
+#define MBOX_CTRL_FLUSH 0x03
+/* Flash in [offset, offset + len) changed behind our back, reload it */
+#define MBOX_CTRL_INVALIDATE 0x04
+/* Statistics as text */
+#define MBOX_CTRL_STATS 0x05
+/*
+ * Write a new image to [offset, offset + len) of a suspended host's flash,
+ * both erase block aligned. Once answered the client sends the image as
+ * plain data messages, the final response (with a summary as text) comes
+ * after the last of it is on flash. Only erase blocks that differ from what
+ * is on flash are rewritten.
+ */
+#define MBOX_CTRL_UPDATE 0x06
+/*
+ * Copy of [offset, offset + len) of a host's flash as it stands, unflushed
+ * writes included. The response is followed by one data message for every
+ * MBOX_CTRL_CHUNK of the range, PackBits encoded with MBOX_CTRL_F_COMPRESS.
+ */
+#define MBOX_CTRL_SNAPSHOT 0x07
+
+/*
+ * Start tracking changes to the flash of the host(s) so that they can be
+ * undone, replacing any earlier snapshot. ROLLBACK writes back the blocks
+ * that changed since, to a suspended host's flash, answered like UPDATE
+ * once it's done. DROP forgets the snapshot.
+ */
+#define MBOX_CTRL_SNAP_CREATE 0x08
+#define MBOX_CTRL_SNAP_ROLLBACK 0x09
+#define MBOX_CTRL_SNAP_DROP 0x0a
+/*
+ * Write everything held in the host(s)' flash overlay out to the SPI, see
+ * --overlay. Answered once it's there.
+ */
+#define MBOX_CTRL_FLATTEN 0x0b
+/*
+ * Make the secondary chip of the host(s)' flash the primary, see --mirror.
+ * Outstanding writes and mirroring are finished first, it's answered once
+ * the chips are swapped. A scan in progress starts over on the new primary.
+ * Refused while there is an overlay or snapshot tied to the current primary.
+ */
+#define MBOX_CTRL_SWITCH 0x0c
+/*
+ * Start a background scan of the host(s)' flash against the CRC index,
+ * see mboxd_scan.h. Answered straight away, the outcome is in STATS.
+ */
+#define MBOX_CTRL_SCAN 0x0d
+/*
+ * Wear telemetry of every flash as text: erase and program totals, then
+ * the most erased blocks with their erase and program times.
+ */
+#define MBOX_CTRL_WEAR 0x0e
+
+/* Flags */
+#define MBOX_CTRL_F_COMPRESS 0x01
+
+#define MBOX_CTRL_CHUNK (32 << 10)
+
+#define MBOX_CTRL_OK 0x00
+#define MBOX_CTRL_ERR_PARAM 0x01
+#define MBOX_CTRL_ERR_IO 0x02
+#define MBOX_CTRL_ERR_UNKNOWN 0x03
+/* Not now, eg the host isn't suspended or an update is in progress */
+#define MBOX_CTRL_ERR_STATE 0x04
+
+/* Address every host */
+#define MBOX_CTRL_ALL_HOSTS 0xff
+
+struct mbox_ctrl_msg {
+	uint8_t command;
+	uint8_t host;
+	uint8_t status;
+	uint8_t flags;
+	uint32_t offset;
+	uint32_t len;
+} __attribute__((packed));
+
+#define MBOX_CTRL_MAX_CLIENTS 4
+/* Slots in the poll set, the listening socket then each client */
+#define MBOX_CTRL_FDS (1 + MBOX_CTRL_MAX_CLIENTS)
+/* Largest response, STATS included */
+#define MBOX_CTRL_MSG_MAX 4096
+
+/* Erase blocks of an update queued for flash before we stop reading more */
+#define MBOX_CTRL_UPDATE_DEPTH 4
+
+struct mbox_context;
+
+struct mbox_ctrl_update {
+	/* UPDATE, or SNAP_ROLLBACK which writes through the same path */
+	uint8_t command;
+	/* The client streaming the image, -1 once it's all in or gone */
+	int client;
+	struct mbox_context *context;
+	uint32_t pos;
+	uint32_t len;
+	uint32_t received;
+	/* Erase blocks received and compared with the flash */
+	uint32_t checked;
+	unsigned int outstanding;
+	unsigned long changed;
+	uint64_t start;
+	int rc;
+	/* Flash content for blocks the hash index doesn't know */
+	void *buf;
+};
+
+/* A command to answer once the flash work it's waiting on is done */
+struct mbox_ctrl_wait {
+	/* The client to answer, -1 if it has gone */
+	int client;
+	bool busy;
+	struct mbox_ctrl_msg msg;
+	/* Hosts or flashes still working, plus one while it's being queued */
+	unsigned int outstanding;
+	int rc;
+};
+
+struct mbox_ctrl_snapshot {
+	/* The client it's streamed to, -1 when there's none in progress */
+	int client;
+	uint8_t flags;
+	uint32_t len;
+	uint32_t sent;
+	uint8_t *buf;
+	/* One encoded chunk */
+	uint8_t *out;
+	uint64_t start;
+	unsigned long long bytes;
+};
+
+struct mbox_ctrl {
+	char *path;
+	int fd;
+	int clients[MBOX_CTRL_MAX_CLIENTS];
+	struct mbox_context **contexts;
+	int n;
+	/* Flash time spent on behalf of BMC side tools */
+	struct mbox_client client;
+	struct mbox_ctrl_update update;
+	struct mbox_ctrl_snapshot snapshot;
+	struct mbox_ctrl_wait wait;
+};
+
+int ctrl_init(struct mbox_ctrl *ctrl, const char *path,
+		struct mbox_context **contexts, int n);
+
+void ctrl_pollfds(struct mbox_ctrl *ctrl, struct pollfd *fds);
+
+void ctrl_dispatch(struct mbox_ctrl *ctrl, struct pollfd *fds);
+
+void ctrl_free(struct mbox_ctrl *ctrl);
+
+#endif /* MBOXD_CTRL_H */
@@ -0,0 +1,304 @@
+/* Copyright 2016 IBM
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *    http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *	Unless required by applicable law or agreed to in writing, software
+ *	distributed under the License is distributed on an "AS IS" BASIS,
+ *	WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *	See the License for the specific language governing permissions and
+ *	limitations under the License.
+ *
+ */
+
+#define _GNU_SOURCE
+#include <endian.h>
+#include <errno.h>
+#include <stdarg.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <syslog.h>
+
+#include "mbox.h"
+#include "common.h"
+#include "mboxd.h"
+#include "mboxd_ecc.h"
+#include "mboxd_flash.h"
+
+/* The FFS table of contents at the start of the PNOR, all big endian */
+#define FFS_MAGIC 0x50415254
+#define FFS_ENTRY_SIZE 128
+#define FFS_ENTRY_INTEG_ECC 0x8000
+
+struct ffs_hdr {
+	uint32_t magic;
+	uint32_t version;
+	uint32_t size;
+	uint32_t entry_size;
+	uint32_t entry_count;
+	uint32_t block_size;
+	uint32_t block_count;
+	uint32_t resvd[4];
+	uint32_t checksum;
+} __attribute__((packed));
+
+struct ffs_entry {
+	char name[16];
+	uint32_t base;
+	uint32_t size;
+	uint32_t pid;
+	uint32_t id;
+	uint32_t type;
+	uint32_t flags;
+	uint32_t actual;
+	uint32_t resvd[4];
+	struct {
+		uint8_t chip;
+		uint8_t compresstype;
+		uint16_t datainteg;
+		uint8_t vercheck;
+		uint8_t miscflags;
+		uint8_t freemisc[2];
+		uint32_t reserved[14];
+	} __attribute__((packed)) user;
+	uint32_t checksum;
+} __attribute__((packed));
+
+/* Each is XORed with the words it covers, checksum included, to give 0 */
+static uint32_t ffs_checksum(const void *buf, size_t len)
+{
+	const uint32_t *word = buf;
+	uint32_t csum = 0;
+
+	for (; len >= sizeof(*word); len -= sizeof(*word))
+		csum ^= *word++;
+
+	return csum;
+}
+
+/* Row i gives ECC bit i as the parity of the data bits it selects */
+static const uint64_t ecc_matrix[8] = {
+	0x0000e8423c0f99ffULL,
+	0x00e8423c0f99ff00ULL,
+	0xe8423c0f99ff0000ULL,
+	0x423c0f99ff0000e8ULL,
+	0x3c0f99ff0000e842ULL,
+	0x0f99ff0000e8423cULL,
+	0x99ff0000e8423c0fULL,
+	0xff0000e8423c0f99ULL,
+};
+
+/*
+ * What a non-zero syndrome means: the data bit to flip, a bad bit in the
+ * ECC byte itself, or more than one bad bit.
+ */
+#define ECC_SYN_CHECK 0xfe
+#define ECC_SYN_UE 0xff
+
+static uint8_t ecc_syndrome[256];
+
+/*
+ * ECC is linear in the data, so it's the XOR of the ECC of each byte on
+ * its own: a table lookup per byte rather than a parity per ECC bit.
+ */
+static uint8_t ecc_byte[8][256];
+
+static uint8_t ecc_generate_slow(uint64_t data)
+{
+	uint8_t ecc = 0;
+	int i;
+
+	for (i = 0; i < 8; i++)
+		ecc |= __builtin_parityll(ecc_matrix[i] & data) << i;
+
+	return ecc;
+}
+
+static void ecc_syndrome_init(void)
+{
+	int bit, i, v;
+
+	for (i = 0; i < 8; i++) {
+		for (v = 0; v < 256; v++)
+			ecc_byte[i][v] = ecc_generate_slow((uint64_t)v << (8 * i));
+	}
+
+	memset(ecc_syndrome, ECC_SYN_UE, sizeof(ecc_syndrome));
+	for (i = 0; i < 8; i++)
+		ecc_syndrome[1 << i] = ECC_SYN_CHECK;
+	for (bit = 0; bit < 64; bit++) {
+		uint8_t syn = 0;
+
+		for (i = 0; i < 8; i++)
+			syn |= ((ecc_matrix[i] >> bit) & 1) << i;
+		ecc_syndrome[syn] = bit;
+	}
+}
+
+static inline uint8_t ecc_generate(uint64_t data)
+{
+	return ecc_byte[0][data & 0xff] ^ ecc_byte[1][(data >> 8) & 0xff] ^
+		ecc_byte[2][(data >> 16) & 0xff] ^
+		ecc_byte[3][(data >> 24) & 0xff] ^
+		ecc_byte[4][(data >> 32) & 0xff] ^
+		ecc_byte[5][(data >> 40) & 0xff] ^
+		ecc_byte[6][(data >> 48) & 0xff] ^ ecc_byte[7][data >> 56];
+}
+
+/*
+ * Find the ECC partitions in the table of contents. A flash without one
+ * (or with a broken one) just has nothing to check.
+ */
+int ecc_init(struct mbox_context *context)
+{
+	struct mbox_flash *flash = context->flash;
+	uint32_t count, block, base, size, i;
+	struct ffs_entry *entry;
+	struct ffs_hdr *hdr;
+	uint8_t *toc;
+	size_t len;
+	int rc;
+
+	if (!context->ecc || flash->ecc_parsed)
+		return 0;
+	flash->ecc_parsed = true;
+
+	/* Syndrome 0 is clean, so it's only ever 0 before this */
+	if (!ecc_syndrome[0])
+		ecc_syndrome_init();
+
+	len = flash->mtd_info.erasesize;
+	toc = malloc(len);
+	if (!toc)
+		return -ENOMEM;
+
+	rc = flash_read_buf(context, toc, 0, len);
+	if (rc)
+		goto out;
+
+	hdr = (struct ffs_hdr *)toc;
+	count = be32toh(hdr->entry_count);
+	block = be32toh(hdr->block_size);
+	if (be32toh(hdr->magic) != FFS_MAGIC ||
+			be32toh(hdr->entry_size) != FFS_ENTRY_SIZE ||
+			ffs_checksum(hdr, sizeof(*hdr)) ||
+			count > (len - sizeof(*hdr)) / FFS_ENTRY_SIZE) {
+		MSG_OUT("No FFS table of contents on %s, no ECC to check\n",
+				flash->path);
+		goto out;
+	}
+
+	entry = (struct ffs_entry *)(hdr + 1);
+	for (i = 0; i < count; i++, entry++) {
+		struct mbox_range *more;
+
+		if (ffs_checksum(entry, sizeof(*entry)) ||
+				!(be16toh(entry->user.datainteg) &
+					FFS_ENTRY_INTEG_ECC))
+			continue;
+
+		base = be32toh(entry->base) * block;
+		size = be32toh(entry->size) * block;
+		if (base >= flash->mtd_info.size ||
+				size > flash->mtd_info.size - base)
+			continue;
+
+		more = realloc(flash->ecc, (flash->ecc_n + 1) * sizeof(*more));
+		if (!more) {
+			rc = -ENOMEM;
+			goto out;
+		}
+		flash->ecc = more;
+		flash->ecc[flash->ecc_n].pos = base;
+		flash->ecc[flash->ecc_n++].len = size;
+		MSG_OUT("Partition %.15s at 0x%08x for 0x%08x is ECC protected\n",
+				entry->name, base, size);
+	}
+
+out:
+	free(toc);
+	return rc;
+}
+
+/*
+ * 'buf' holding [pos, pos + len) of the window, a whole number of 9 byte
+ * ECC words
+ */
+static void ecc_check_words(struct mbox_context *context, uint8_t *buf,
+		uint32_t pos, uint32_t len)
+{
+	uint8_t *p = buf;
+	uint8_t *end = p + len;
+	uint64_t raw, data;
+	uint8_t syn, bit;
+
+	for (; p < end; p += 9) {
+		memcpy(&raw, p, sizeof(raw));
+		data = be64toh(raw);
+		syn = ecc_generate(data) ^ p[8];
+		context->ecc_stats.words++;
+		if (!syn)
+			continue;
+
+		bit = ecc_syndrome[syn];
+		if (bit == ECC_SYN_UE) {
+			context->ecc_stats.uncorrectable++;
+			MSG_ERR("Uncorrectable ECC error at 0x%08x\n",
+					pos + (uint32_t)(p - buf));
+			continue;
+		}
+
+		if (bit == ECC_SYN_CHECK) {
+			p[8] ^= syn;
+		} else {
+			raw = htobe64(data ^ (1ULL << bit));
+			memcpy(p, &raw, sizeof(raw));
+		}
+		context->ecc_stats.corrected++;
+	}
+}
+
+/*
+ * Check and correct the ECC words wholly inside [pos, pos + len) of the
+ * window. Words are counted from the start of their partition, one split
+ * across the edge of the range is left for a check that covers it all.
+ */
+void ecc_check(struct mbox_context *context, uint32_t pos, uint32_t len)
+{
+	ecc_check_buf(context, context->lpc_mem + pos, pos, len);
+}
+
+/* As ecc_check(), on 'buf' holding [pos, pos + len) rather than the window */
+void ecc_check_buf(struct mbox_context *context, void *buf, uint32_t pos,
+		uint32_t len)
+{
+	struct mbox_flash *flash = context->flash;
+	uint32_t start, end, first;
+	int i;
+
+	if (!context->ecc)
+		return;
+
+	for (i = 0; i < flash->ecc_n; i++) {
+		start = pos > flash->ecc[i].pos ? pos : flash->ecc[i].pos;
+		end = flash->ecc[i].pos + flash->ecc[i].len;
+		if (pos + len < end)
+			end = pos + len;
+		if (end > context->size)
+			end = context->size;
+		if (start >= end)
+			continue;
+
+		first = start - flash->ecc[i].pos;
+		first = flash->ecc[i].pos + (first + 8) / 9 * 9;
+		if (first >= end || end - first < 9)
+			continue;
+		ecc_check_words(context, (uint8_t *)buf + first - pos, first,
+				(end - first) / 9 * 9);
+	}
+}
@@ -0,0 +1,39 @@
+/* Copyright 2016 IBM
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *    http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *	Unless required by applicable law or agreed to in writing, software
+ *	distributed under the License is distributed on an "AS IS" BASIS,
+ *	WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *	See the License for the specific language governing permissions and
+ *	limitations under the License.
+ *
+ */
+
+#ifndef MBOXD_ECC_H
+#define MBOXD_ECC_H
+
+#include <stdint.h>
+
+#include "mboxd.h"
+
+/*
+ * PNOR partitions flagged as ECC protected in the FFS table of contents
+ * carry an ECC byte after every 8 bytes of data: SEC-DED, so one flipped
+ * bit in the 9 is corrected and two are detected. With --ecc, data coming
+ * into the window from flash and dirty data on its way out are checked,
+ * and corrected in the window where possible.
+ */
+
+int ecc_init(struct mbox_context *context);
+
+void ecc_check(struct mbox_context *context, uint32_t pos, uint32_t len);
+
+void ecc_check_buf(struct mbox_context *context, void *buf, uint32_t pos,
+		uint32_t len);
+
+#endif /* MBOXD_ECC_H */
@@ -0,0 +1,1190 @@
+/* Copyright 2016 IBM
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *    http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *	Unless required by applicable law or agreed to in writing, software
+ *	distributed under the License is distributed on an "AS IS" BASIS,
+ *	WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *	See the License for the specific language governing permissions and
+ *	limitations under the License.
+ *
+ */
+
+#define _GNU_SOURCE
+#include <assert.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdarg.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <syslog.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "common.h"
+#include "mboxd_ecc.h"
+#include "mboxd_flash.h"
+#include "mboxd_scan.h"
+#include "mboxd_wear.h"
+
+static struct mbox_flash *flashes;
+
+/* Which host writes go to an overlay instead of the SPI, see --overlay */
+static struct {
+	bool enabled;
+	/* NULL for RAM */
+	const char *path;
+	struct mbox_range *ranges;
+	int n;
+} overlay_policy;
+
+/* "ram", or a file to keep it in, for every flash opened after */
+int flash_overlay_policy(const char *spec)
+{
+	overlay_policy.enabled = true;
+	overlay_policy.path = strcmp(spec, "ram") ? spec : NULL;
+
+	return 0;
+}
+
+/* Limit the overlay to [pos, pos + len), eg a partition, may be repeated */
+int flash_overlay_range(uint32_t pos, uint32_t len)
+{
+	struct mbox_range *ranges;
+
+	ranges = realloc(overlay_policy.ranges,
+			(overlay_policy.n + 1) * sizeof(*ranges));
+	if (!ranges)
+		return -ENOMEM;
+
+	ranges[overlay_policy.n].pos = pos;
+	ranges[overlay_policy.n++].len = len;
+	overlay_policy.ranges = ranges;
+
+	return 0;
+}
+
+/* The file is named after the MTD so that each flash gets its own */
+static int flash_overlay_init(struct mbox_flash *flash)
+{
+	uint32_t blocks = flash->mtd_info.size / flash->mtd_info.erasesize;
+	const char *mtd = strrchr(flash->path, '/');
+	char *path = NULL;
+	struct stat st;
+	uint32_t blk;
+	int fd = -1, rc;
+
+	if (!overlay_policy.enabled)
+		return 0;
+
+	flash->overlay_size = flash->mtd_info.size + (blocks + 7) / 8;
+	if (overlay_policy.path) {
+		if (asprintf(&path, "%s.%s", overlay_policy.path,
+					mtd ? mtd + 1 : flash->path) < 0)
+			return -ENOMEM;
+		fd = open(path, O_RDWR | O_CREAT | O_CLOEXEC, S_IRUSR | S_IWUSR);
+		if (fd < 0 || fstat(fd, &st) < 0) {
+			MSG_ERR("Couldn't open overlay %s: %s\n", path,
+					strerror(errno));
+			goto err;
+		}
+		/* Whatever was there isn't for a flash of this shape */
+		if (st.st_size != (off_t)flash->overlay_size &&
+				(ftruncate(fd, 0) < 0 ||
+				 ftruncate(fd, flash->overlay_size) < 0)) {
+			MSG_ERR("Couldn't size overlay %s: %s\n", path,
+					strerror(errno));
+			goto err;
+		}
+		flash->overlay = mmap(NULL, flash->overlay_size,
+				PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+		close(fd);
+		fd = -1;
+	} else {
+		flash->overlay = mmap(NULL, flash->overlay_size,
+				PROT_READ | PROT_WRITE,
+				MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	}
+	if (flash->overlay == MAP_FAILED) {
+		MSG_ERR("Couldn't map overlay: %s\n", strerror(errno));
+		flash->overlay = NULL;
+		goto err;
+	}
+	flash->overlay_map = flash->overlay + flash->mtd_info.size;
+
+	for (blk = 0; blk < blocks; blk++) {
+		if (flash->overlay_map[blk / 8] & (1 << (blk % 8)))
+			flash->overlay_blocks++;
+	}
+	MSG_OUT("Host writes to %s go to an overlay in %s, %u erase blocks already there\n",
+			flash->path, path ? path : "RAM", flash->overlay_blocks);
+	free(path);
+
+	return 0;
+
+err:
+	rc = -errno;
+	if (fd >= 0)
+		close(fd);
+	free(path);
+	return rc;
+}
+
+bool flash_overlay_has(struct mbox_flash *flash, uint32_t pos)
+{
+	uint32_t blk = pos / flash->mtd_info.erasesize;
+
+	return flash->overlay &&
+		(flash->overlay_map[blk / 8] & (1 << (blk % 8)));
+}
+
+static void flash_overlay_set(struct mbox_flash *flash, uint32_t pos,
+		bool present)
+{
+	uint32_t blk = pos / flash->mtd_info.erasesize;
+
+	if (present == flash_overlay_has(flash, pos))
+		return;
+
+	if (present) {
+		flash->overlay_map[blk / 8] |= 1 << (blk % 8);
+		flash->overlay_blocks++;
+	} else {
+		flash->overlay_map[blk / 8] &= ~(1 << (blk % 8));
+		flash->overlay_blocks--;
+	}
+}
+
+/* Whether a host write of the erase block at 'pos' stays off the SPI */
+bool flash_overlaid(struct mbox_flash *flash, uint32_t pos)
+{
+	int i;
+
+	if (!flash->overlay)
+		return false;
+	if (!overlay_policy.n)
+		return true;
+
+	for (i = 0; i < overlay_policy.n; i++) {
+		if (pos >= overlay_policy.ranges[i].pos &&
+				pos - overlay_policy.ranges[i].pos <
+				overlay_policy.ranges[i].len)
+			return true;
+	}
+
+	return false;
+}
+
+/*
+ * A regular file is a PNOR image rather than a MTD. It's mapped and used in
+ * place: reads come out of the page cache, programs land in it and are
+ * synced to the file in batches, see flash_sync().
+ */
+static int flash_image_init(struct mbox_flash *flash, const char *path)
+{
+	struct stat st;
+
+	if (fstat(flash->fd, &st) < 0) {
+		MSG_ERR("Couldn't stat %s: %s\n", path, strerror(errno));
+		return -errno;
+	}
+	if (!S_ISREG(st.st_mode))
+		return 0;
+
+	if (!st.st_size || st.st_size % FLASH_IMAGE_ERASESIZE ||
+			st.st_size > UINT32_MAX) {
+		MSG_ERR("Image %s isn't a whole number of 0x%x erase blocks\n",
+				path, FLASH_IMAGE_ERASESIZE);
+		return -EINVAL;
+	}
+
+	flash->image = mmap(NULL, st.st_size, PROT_READ | PROT_WRITE,
+			MAP_SHARED, flash->fd, 0);
+	if (flash->image == MAP_FAILED) {
+		MSG_ERR("Couldn't map image %s: %s\n", path, strerror(errno));
+		flash->image = NULL;
+		return -errno;
+	}
+
+	flash->mtd_info.type = MTD_RAM;
+	flash->mtd_info.size = st.st_size;
+	flash->mtd_info.erasesize = FLASH_IMAGE_ERASESIZE;
+	flash->mtd_info.writesize = 1;
+	flash->sync_start = flash->mtd_info.size;
+	flash->sync_end = 0;
+	MSG_OUT("Serving image %s, 0x%08x bytes\n", path, flash->mtd_info.size);
+
+	return 0;
+}
+
+/* Write what's been programmed into an image out to the file */
+int flash_sync(struct mbox_flash *flash)
+{
+	long page = sysconf(_SC_PAGESIZE);
+	uint32_t start;
+
+	if (!flash->image || flash->sync_start >= flash->sync_end)
+		return 0;
+
+	start = flash->sync_start & ~(page - 1);
+	if (msync(flash->image + start, flash->sync_end - start, MS_SYNC) < 0) {
+		MSG_ERR("Couldn't sync image %s: %s\n", flash->path,
+				strerror(errno));
+		return -errno;
+	}
+	flash->sync_start = flash->mtd_info.size;
+	flash->sync_end = 0;
+
+	return 0;
+}
+
+static void flash_image_free(struct mbox_flash *flash)
+{
+	if (!flash->image)
+		return;
+
+	flash_sync(flash);
+	munmap(flash->image, flash->mtd_info.size);
+	flash->image = NULL;
+}
+
+/* Open an MTD, or take another reference to it if a host already has */
+struct mbox_flash *flash_get(const char *path)
+{
+	struct mbox_flash *flash;
+
+	for (flash = flashes; flash; flash = flash->next) {
+		if (!strcmp(flash->path, path)) {
+			flash->users++;
+			return flash;
+		}
+	}
+
+	flash = calloc(1, sizeof(*flash));
+	if (!flash)
+		return NULL;
+
+	MSG_OUT("Opening %s\n", path);
+	flash->fd = open(path, O_RDWR);
+	if (flash->fd < 0) {
+		MSG_ERR("Couldn't open %s with flags O_RDWR: %s\n", path,
+				strerror(errno));
+		free(flash);
+		return NULL;
+	}
+
+	if (flash_image_init(flash, path)) {
+		close(flash->fd);
+		free(flash);
+		return NULL;
+	}
+
+	if (!flash->image &&
+			ioctl(flash->fd, MEMGETINFO, &flash->mtd_info) == -1) {
+		MSG_ERR("Couldn't get information about MTD: %s\n", strerror(errno));
+		close(flash->fd);
+		free(flash);
+		return NULL;
+	}
+
+	flash->path = strdup(path);
+	if (scan_index_init(flash)) {
+		MSG_ERR("Couldn't allocate flash block index\n");
+		scan_free(flash);
+		free(flash->path);
+		flash_image_free(flash);
+		close(flash->fd);
+		free(flash);
+		return NULL;
+	}
+
+	if (flash_overlay_init(flash)) {
+		scan_free(flash);
+		free(flash->path);
+		flash_image_free(flash);
+		close(flash->fd);
+		free(flash);
+		return NULL;
+	}
+
+	/* Nice to have, the flash is usable without it */
+	if (wear_init(flash))
+		MSG_ERR("Couldn't set up wear telemetry for %s\n", path);
+
+	flash->users = 1;
+	flash->next = flashes;
+	flashes = flash;
+
+	return flash;
+}
+
+void flash_put(struct mbox_flash *flash)
+{
+	struct mbox_flash **pos = &flashes;
+
+	if (!flash || --flash->users)
+		return;
+
+	/* The last host is gone, so is the pairing */
+	if (flash->mirror) {
+		flash->mirror->mirror = NULL;
+		flash_put(flash->mirror);
+	}
+
+	while (*pos != flash)
+		pos = &(*pos)->next;
+	*pos = flash->next;
+
+	flash_snap_free(flash, flash->snap);
+	if (flash->overlay)
+		munmap(flash->overlay, flash->overlay_size);
+	flash_image_free(flash);
+	close(flash->fd);
+	free(flash->cache);
+	free(flash->cached);
+	scan_free(flash);
+	free(flash->gen);
+	free(flash->mirror_buf);
+	free(flash->verify_buf);
+	wear_free(flash);
+	free(flash->ecc);
+	free(flash->path);
+	free(flash);
+}
+
+static bool flash_cache_init(struct mbox_flash *flash)
+{
+	uint32_t blocks;
+
+	/* An image is already shared through the page cache */
+	if (flash->users < 2 || flash->image)
+		return false;
+	if (flash->cache)
+		return true;
+
+	blocks = flash->mtd_info.size / flash->mtd_info.erasesize;
+	flash->cache = malloc(flash->mtd_info.size);
+	flash->cached = calloc((blocks + 7) / 8, 1);
+	if (!flash->cache || !flash->cached) {
+		MSG_ERR("Couldn't allocate shared flash cache, not sharing\n");
+		free(flash->cache);
+		free(flash->cached);
+		flash->cache = NULL;
+		flash->cached = NULL;
+		return false;
+	}
+
+	MSG_OUT("Sharing a flash cache for %s between %u hosts\n",
+			flash->path, flash->users);
+
+	return true;
+}
+
+/* Forget everything cached, the flash changed behind our back */
+void flash_cache_drop(struct mbox_flash *flash)
+{
+	uint32_t blocks = flash->mtd_info.size / flash->mtd_info.erasesize;
+
+	if (flash->cached)
+		memset(flash->cached, 0, (blocks + 7) / 8);
+	scan_index_forget(flash, 0, flash->mtd_info.size);
+}
+
+static bool flash_cached(struct mbox_flash *flash, uint32_t pos)
+{
+	uint32_t blk = pos / flash->mtd_info.erasesize;
+
+	return flash->cached && (flash->cached[blk / 8] & (1 << (blk % 8)));
+}
+
+static void flash_cache_set(struct mbox_flash *flash, uint32_t pos,
+		bool valid)
+{
+	uint32_t blk = pos / flash->mtd_info.erasesize;
+
+	if (!flash->cached)
+		return;
+
+	if (valid)
+		flash->cached[blk / 8] |= 1 << (blk % 8);
+	else
+		flash->cached[blk / 8] &= ~(1 << (blk % 8));
+}
+
+/* The content of [pos, pos + len) changed, the mirror needs it again */
+static void flash_gen_bump(struct mbox_flash *flash, uint32_t pos,
+		uint32_t len)
+{
+	uint32_t erasesize = flash->mtd_info.erasesize;
+	uint32_t off;
+
+	if (!flash->gen)
+		return;
+
+	/* Zero is a mirror block that has never been synced */
+	if (!++flash->gen_next)
+		flash->gen_next = 1;
+	for (off = pos & ~(erasesize - 1); off < pos + len; off += erasesize)
+		flash->gen[off / erasesize] = flash->gen_next;
+	flash->mirror_stale = true;
+}
+
+/* Forget the cached copy of the erase blocks in [pos, pos + len) */
+void flash_cache_invalidate(struct mbox_flash *flash, uint32_t pos,
+		uint32_t len)
+{
+	uint32_t erasesize = flash->mtd_info.erasesize;
+	uint32_t off;
+
+	for (off = pos & ~(erasesize - 1); off < pos + len; off += erasesize)
+		flash_cache_set(flash, off, false);
+	flash_gen_bump(flash, pos, len);
+	scan_index_forget(flash, pos, len);
+}
+
+/*
+ * Raw access to one chip, MTD or image. Everything above these keeps the
+ * indexes, cache and overlay straight.
+ */
+/* An image is only mapped as far as it goes, nothing may reach past that */
+static bool chip_in_image(struct mbox_flash *flash, uint32_t pos,
+		uint32_t len)
+{
+	if (pos <= flash->mtd_info.size && len <= flash->mtd_info.size - pos)
+		return true;
+
+	MSG_ERR("0x%08x bytes at 0x%08x is past the end of image %s\n", len,
+			pos, flash->path);
+
+	return false;
+}
+
+static int chip_read(struct mbox_flash *flash, void *buf, uint32_t pos,
+		uint32_t len)
+{
+	ssize_t rc;
+
+	if (flash->image) {
+		if (!chip_in_image(flash, pos, len))
+			return -EINVAL;
+		memcpy(buf, flash->image + pos, len);
+		return 0;
+	}
+
+	while (len) {
+		rc = pread(flash->fd, buf, len, pos);
+		if (rc == -1) {
+			MSG_ERR("Couldn't read 0x%08x from flash: %s\n", pos,
+					strerror(errno));
+			return -errno;
+		}
+		if (rc == 0) {
+			MSG_ERR("Short read at 0x%08x: 0x%08x remaining\n", pos, len);
+			return -EIO;
+		}
+		buf += rc;
+		len -= rc;
+		pos += rc;
+	}
+
+	return 0;
+}
+
+static int chip_erase(struct mbox_flash *flash, uint32_t pos, uint32_t len)
+{
+	struct erase_info_user erase_info = {
+		.start = pos,
+		.length = len,
+	};
+	uint64_t start = mbox_clock_ns();
+
+	if (flash->image) {
+		if (!chip_in_image(flash, pos, len))
+			return -EINVAL;
+		memset(flash->image + pos, 0xff, len);
+	} else if (ioctl(flash->fd, MEMERASE, &erase_info) == -1) {
+		MSG_ERR("Couldn't MEMERASE ioctl, flash write lost: %s\n", strerror(errno));
+		return -errno;
+	}
+	wear_erase(flash, pos, len, mbox_clock_ns() - start);
+
+	return 0;
+}
+
+static int chip_write(struct mbox_flash *flash, const uint8_t *data,
+		uint32_t pos, uint32_t len)
+{
+	uint64_t now = mbox_clock_ns();
+	uint32_t start = pos, end = pos + len;
+	ssize_t rc;
+
+	if (flash->image) {
+		if (!chip_in_image(flash, pos, len))
+			return -EINVAL;
+		memcpy(flash->image + pos, data, len);
+		if (pos < flash->sync_start)
+			flash->sync_start = pos;
+		if (pos + len > flash->sync_end)
+			flash->sync_end = pos + len;
+		/* Nothing for pwrite() to do */
+		len = 0;
+	}
+
+	while (len) {
+		rc = pwrite(flash->fd, data + pos - start, len, pos);
+		if (rc == -1) {
+			MSG_ERR("Couldn't write to flash! Flash write lost: %s\n", strerror(errno));
+			return -errno;
+		}
+		len -= rc;
+		pos += rc;
+	}
+	wear_program(flash, start, end - start, mbox_clock_ns() - now);
+
+	return 0;
+}
+
+/* What's on the chip itself, overlay and mirror aside */
+int flash_read_raw(struct mbox_flash *flash, void *buf, uint32_t pos,
+		uint32_t len)
+{
+	return chip_read(flash, buf, pos, len);
+}
+
+static int flash_pread(struct mbox_context *context, void *buf, uint32_t pos,
+		uint32_t len)
+{
+	assert(context);
+
+	return chip_read(context->flash, buf, pos, len);
+}
+
+/* The flash as the host should see it, overlay included */
+static int flash_fetch(struct mbox_context *context, void *buf, uint32_t pos,
+		uint32_t len)
+{
+	struct mbox_flash *flash = context->flash;
+	int rc;
+
+	if (flash_overlay_has(flash, pos)) {
+		memcpy(buf, flash->overlay + pos, len);
+		return 0;
+	}
+
+	rc = flash_pread(context, buf, pos, len);
+	/* Only programs go in the index, a read can only contradict it */
+	if (!rc)
+		scan_index_check(flash, buf, pos, len);
+
+	return rc;
+}
+
+/*
+ * Reads go through the shared cache when there is one. Whole erase blocks
+ * are cached so other hosts on the same flash only ever read it once.
+ */
+int flash_read_buf(struct mbox_context *context, void *buf, uint32_t pos,
+		uint32_t len)
+{
+	struct mbox_flash *flash = context->flash;
+	uint32_t erasesize = flash->mtd_info.erasesize;
+	bool cache = flash_cache_init(flash);
+	uint32_t blk, off, n;
+	int rc;
+
+	if (!cache && !flash->overlay_blocks)
+		return flash_fetch(context, buf, pos, len);
+
+	while (len) {
+		blk = pos & ~(erasesize - 1);
+		off = pos - blk;
+		n = erasesize - off < len ? erasesize - off : len;
+
+		if (!cache) {
+			rc = flash_fetch(context, buf, pos, n);
+			if (rc)
+				return rc;
+		} else if (!flash_cached(flash, blk)) {
+			rc = flash_fetch(context, flash->cache + blk, blk,
+					erasesize);
+			if (rc)
+				return rc;
+			flash_cache_set(flash, blk, true);
+		}
+		if (cache)
+			memcpy(buf, flash->cache + pos, n);
+
+		buf += n;
+		len -= n;
+		pos += n;
+	}
+
+	return 0;
+}
+
+int flash_read(struct mbox_context *context, uint32_t pos, uint32_t len)
+{
+	int rc;
+
+	rc = flash_read_buf(context, context->lpc_mem + pos, pos, len);
+	if (!rc)
+		ecc_check(context, pos, len);
+
+	return rc;
+}
+
+/* Taking one is O(1), blocks are only copied once they're about to change */
+int flash_snap_create(struct mbox_flash *flash)
+{
+	uint32_t blocks = flash->mtd_info.size / flash->mtd_info.erasesize;
+	struct mbox_flash_snap *snap;
+
+	snap = calloc(1, sizeof(*snap));
+	if (!snap)
+		return -ENOMEM;
+
+	snap->blocks = calloc(blocks, sizeof(*snap->blocks));
+	if (!snap->blocks) {
+		free(snap);
+		return -ENOMEM;
+	}
+	snap->created = mbox_clock_ns();
+
+	/* There's only ever the one, a new snapshot replaces the last */
+	flash_snap_free(flash, flash_snap_detach(flash));
+	flash->snap = snap;
+	MSG_OUT("Snapshot of %s taken\n", flash->path);
+
+	return 0;
+}
+
+/* Stop tracking changes, eg to write the snapshot back */
+struct mbox_flash_snap *flash_snap_detach(struct mbox_flash *flash)
+{
+	struct mbox_flash_snap *snap = flash->snap;
+
+	flash->snap = NULL;
+
+	return snap;
+}
+
+void flash_snap_free(struct mbox_flash *flash, struct mbox_flash_snap *snap)
+{
+	uint32_t blocks = flash->mtd_info.size / flash->mtd_info.erasesize;
+	uint32_t i;
+
+	if (!snap)
+		return;
+
+	for (i = 0; i < blocks; i++)
+		free(snap->blocks[i]);
+	free(snap->blocks);
+	free(snap);
+}
+
+/* Save what's in [pos, pos + len) before it's erased, if not already */
+static int flash_snap_save(struct mbox_context *context, uint32_t pos,
+		uint32_t len)
+{
+	struct mbox_flash *flash = context->flash;
+	uint32_t erasesize = flash->mtd_info.erasesize;
+	struct mbox_flash_snap *snap = flash->snap;
+	uint32_t off, blk;
+	uint8_t *buf;
+	int rc;
+
+	for (off = pos; off < pos + len; off += erasesize) {
+		blk = off / erasesize;
+		if (snap->blocks[blk])
+			continue;
+
+		buf = malloc(erasesize);
+		if (!buf) {
+			MSG_ERR("Couldn't save erase block 0x%08x for the snapshot\n",
+					off);
+			return -ENOMEM;
+		}
+		rc = flash_read_buf(context, buf, off, erasesize);
+		if (rc) {
+			free(buf);
+			return rc;
+		}
+		snap->blocks[blk] = buf;
+		snap->saved++;
+	}
+
+	return 0;
+}
+
+int flash_erase(struct mbox_context *context, uint32_t pos, uint32_t len)
+{
+	uint32_t erasesize = context->flash->mtd_info.erasesize;
+	uint32_t off, length;
+
+	assert(context);
+
+	length = ALIGN_UP(len, erasesize);
+
+	/* A snapshot can't be allowed to lose what's about to be erased */
+	if (context->flash->snap) {
+		int rc = flash_snap_save(context, pos, length);
+
+		if (rc)
+			return rc;
+	}
+
+	for (off = 0; off < length; off += erasesize)
+		flash_cache_set(context->flash, pos + off, false);
+	flash_gen_bump(context->flash, pos, length);
+	scan_index_forget(context->flash, pos, length);
+
+	MSG_OUT("Erasing 0x%08x for 0x%08x (aligned: 0x%08x)\n", pos, len, length);
+
+	return chip_erase(context->flash, pos, length);
+}
+
+int flash_program(struct mbox_context *context, uint32_t pos, uint32_t len)
+{
+	ecc_check(context, pos, len);
+
+	return flash_program_buf(context, context->lpc_mem + pos, pos, len);
+}
+
+/*
+ * Programming only clears bits, a page with a bit clear that should be set
+ * can't be fixed without erasing it again
+ */
+static bool flash_page_programmable(const uint8_t *want, const uint8_t *got,
+		uint32_t len)
+{
+	while (len--) {
+		if (*want++ & ~*got++)
+			return false;
+	}
+
+	return true;
+}
+
+/*
+ * Program again the pages of [pos, pos + len), within one erase block, that
+ * read back different to 'data'. If any of them can't be, and the range is
+ * the whole erase block, erase and program all of it again instead.
+ */
+static int flash_verify_fix(struct mbox_context *context, const uint8_t *data,
+		uint32_t pos, uint32_t len)
+{
+	struct mbox_flash *flash = context->flash;
+	const uint8_t *got = flash->verify_buf;
+	uint32_t page = FLASH_VERIFY_PAGE;
+	uint32_t off, n;
+	int rc;
+
+	if (flash->mtd_info.writesize > page)
+		page = flash->mtd_info.writesize;
+
+	for (off = 0; off < len; off += n) {
+		n = page - (pos + off) % page;
+		if (n > len - off)
+			n = len - off;
+		if (!memcmp(got + off, data + off, n))
+			continue;
+		if (!flash_page_programmable(data + off, got + off, n))
+			goto erase;
+		MSG_ERR("Page at 0x%08x didn't program, trying again\n",
+				pos + off);
+		rc = chip_write(flash, data + off, pos + off, n);
+		if (rc)
+			return rc;
+		context->verify_stats.reprogrammed++;
+	}
+
+	return 0;
+
+erase:
+	if (len != flash->mtd_info.erasesize) {
+		MSG_ERR("0x%08x didn't program and the rest of its erase block is in use\n",
+				pos + off);
+		return -EIO;
+	}
+	MSG_ERR("Erase block 0x%08x didn't program, erasing it again\n", pos);
+	rc = chip_erase(flash, pos, len);
+	if (rc)
+		return rc;
+	context->verify_stats.reerased++;
+
+	return chip_write(flash, data, pos, len);
+}
+
+/*
+ * Read back [pos, pos + len) after programming 'data' to it, an erase block
+ * at a time, fixing up what didn't take.
+ */
+static int flash_verify(struct mbox_context *context, const uint8_t *data,
+		uint32_t pos, uint32_t len)
+{
+	struct mbox_flash *flash = context->flash;
+	uint32_t erasesize = flash->mtd_info.erasesize;
+	uint32_t off, n;
+	int rc, tries;
+
+	/* Nothing between us and the file's pages */
+	if (flash->image)
+		return 0;
+
+	if (!flash->verify_buf) {
+		flash->verify_buf = malloc(erasesize);
+		if (!flash->verify_buf)
+			return -ENOMEM;
+	}
+
+	for (off = pos; off < pos + len; off += n) {
+		n = erasesize - off % erasesize;
+		if (n > pos + len - off)
+			n = pos + len - off;
+
+		for (tries = 0; ; tries++) {
+			rc = chip_read(flash, flash->verify_buf, off, n);
+			if (rc)
+				return rc;
+			if (!memcmp(flash->verify_buf, data + off - pos, n))
+				break;
+			if (tries == FLASH_VERIFY_RETRIES) {
+				MSG_ERR("0x%08x for 0x%08x still reads back wrong, giving up\n",
+						off, n);
+				context->verify_stats.failed++;
+				return -EIO;
+			}
+			rc = flash_verify_fix(context, data + off - pos, off, n);
+			if (rc) {
+				context->verify_stats.failed++;
+				return rc;
+			}
+		}
+		context->verify_stats.blocks++;
+	}
+
+	return 0;
+}
+
+/* Program 'buf' to [pos, pos + len), which is already erased */
+int flash_program_buf(struct mbox_context *context, const void *buf,
+		uint32_t pos, uint32_t len)
+{
+	uint32_t erasesize = context->flash->mtd_info.erasesize;
+	uint32_t start = pos, end = pos + len;
+	const uint8_t *data = buf;
+	int rc;
+
+	assert(context);
+
+	rc = chip_write(context->flash, data, pos, len);
+	if (!rc && context->verify)
+		rc = flash_verify(context, data, pos, len);
+	if (rc)
+		return rc;
+	flash_gen_bump(context->flash, start, end - start);
+	scan_index_update(context->flash, data, start, end - start);
+
+	/*
+	 * Whole erase blocks that made it to flash are what other hosts see,
+	 * and no longer need the overlay
+	 */
+	for (pos = ALIGN_UP(start, erasesize); pos + erasesize <= end;
+			pos += erasesize) {
+		flash_overlay_set(context->flash, pos, false);
+		if (!context->flash->cache)
+			continue;
+		memcpy(context->flash->cache + pos, data + pos - start,
+				erasesize);
+		flash_cache_set(context->flash, pos, true);
+	}
+
+	return 0;
+}
+
+/*
+ * Keep the host's write of whole erase blocks in [pos, pos + len) in the
+ * overlay, no erase needed.
+ */
+int flash_overlay_write(struct mbox_context *context, uint32_t pos,
+		uint32_t len)
+{
+	uint32_t erasesize = context->flash->mtd_info.erasesize;
+
+	len = ALIGN_UP(pos + len, erasesize) - (pos & ~(erasesize - 1));
+	pos &= ~(erasesize - 1);
+
+	ecc_check(context, pos, len);
+
+	return flash_overlay_write_buf(context, context->lpc_mem + pos, pos,
+			len);
+}
+
+/* Keep 'buf', whole erase blocks at 'pos', in the overlay */
+int flash_overlay_write_buf(struct mbox_context *context, const void *buf,
+		uint32_t pos, uint32_t len)
+{
+	struct mbox_flash *flash = context->flash;
+	uint32_t erasesize = flash->mtd_info.erasesize;
+	const uint8_t *data = buf;
+	uint32_t off;
+	int rc;
+
+	if (flash->snap) {
+		rc = flash_snap_save(context, pos, len);
+		if (rc)
+			return rc;
+	}
+
+	for (off = pos; off < pos + len; off += erasesize) {
+		memcpy(flash->overlay + off, data + off - pos, erasesize);
+		flash_overlay_set(flash, off, true);
+		if (flash->cache) {
+			memcpy(flash->cache + off, data + off - pos, erasesize);
+			flash_cache_set(flash, off, true);
+		}
+	}
+
+	return 0;
+}
+
+/*
+ * Move overlay blocks in [pos, pos + len), already erased, to the SPI. What
+ * the host sees doesn't change.
+ */
+int flash_overlay_flatten(struct mbox_context *context, uint32_t pos,
+		uint32_t len)
+{
+	struct mbox_flash *flash = context->flash;
+	uint32_t erasesize = flash->mtd_info.erasesize;
+	uint32_t off;
+	int rc;
+
+	for (off = pos; off < pos + len; off += erasesize) {
+		if (!flash_overlay_has(flash, off))
+			continue;
+		rc = flash_program_buf(context, flash->overlay + off, off,
+				erasesize);
+		if (rc)
+			return rc;
+	}
+
+	return 0;
+}
+
+static int flash_mirror_alloc(struct mbox_flash *flash, uint32_t gen)
+{
+	uint32_t blocks = flash->mtd_info.size / flash->mtd_info.erasesize;
+	uint32_t blk;
+
+	flash->gen = malloc(blocks * sizeof(*flash->gen));
+	flash->mirror_buf = malloc(2 * flash->mtd_info.erasesize);
+	if (!flash->gen || !flash->mirror_buf) {
+		free(flash->gen);
+		free(flash->mirror_buf);
+		flash->gen = NULL;
+		flash->mirror_buf = NULL;
+		return -ENOMEM;
+	}
+
+	for (blk = 0; blk < blocks; blk++)
+		flash->gen[blk] = gen;
+	flash->gen_next = 1;
+	sched_client_init(&flash->mirror_client, "mirror");
+
+	return 0;
+}
+
+/*
+ * Copy host writes to 'flash' to a secondary chip of the same shape in the
+ * background. Nothing is known to be in sync to start with, the first pass
+ * over it only rewrites blocks that differ.
+ */
+int flash_mirror(struct mbox_flash *flash, const char *path)
+{
+	struct mbox_flash *mirror;
+
+	if (flash->mirror) {
+		if (!strcmp(flash->mirror->path, path))
+			return 0;
+		MSG_ERR("%s is already mirrored to %s\n", flash->path,
+				flash->mirror->path);
+		return -EINVAL;
+	}
+
+	mirror = flash_get(path);
+	if (!mirror)
+		return -ENODEV;
+
+	if (mirror == flash || mirror->users > 1 || mirror->mirror ||
+			mirror->mtd_info.size != flash->mtd_info.size ||
+			mirror->mtd_info.erasesize != flash->mtd_info.erasesize) {
+		MSG_ERR("%s can't mirror %s, it's in use or a different size\n",
+				path, flash->path);
+		flash_put(mirror);
+		return -EINVAL;
+	}
+
+	if (flash_mirror_alloc(flash, 1) || flash_mirror_alloc(mirror, 0)) {
+		MSG_ERR("Couldn't allocate mirror generation index\n");
+		free(flash->gen);
+		free(flash->mirror_buf);
+		flash->gen = NULL;
+		flash->mirror_buf = NULL;
+		flash_put(mirror);
+		return -ENOMEM;
+	}
+
+	MSG_OUT("Mirroring %s to %s\n", flash->path, path);
+	/* The secondary's one user is the pairing, see flash_put() */
+	flash->mirror = mirror;
+	mirror->mirror = flash;
+	flash->mirror_stale = true;
+
+	return 0;
+}
+
+/* Whether the mirror has the current content of the erase block at 'pos' */
+bool flash_mirror_synced(struct mbox_flash *flash, uint32_t pos)
+{
+	uint32_t blk = pos / flash->mtd_info.erasesize;
+
+	return flash->mirror && flash->mirror->gen[blk] == flash->gen[blk];
+}
+
+/* The erase blocks the mirror is behind on, as ranges, returns how many */
+int flash_mirror_ranges(struct mbox_flash *flash, struct mbox_range **ranges)
+{
+	uint32_t erasesize = flash->mtd_info.erasesize;
+	uint32_t pos;
+	int n = 0;
+
+	*ranges = NULL;
+	for (pos = 0; pos < flash->mtd_info.size; pos += erasesize) {
+		struct mbox_range *more;
+
+		if (flash_mirror_synced(flash, pos))
+			continue;
+		if (n && (*ranges)[n - 1].pos + (*ranges)[n - 1].len == pos) {
+			(*ranges)[n - 1].len += erasesize;
+			continue;
+		}
+		more = realloc(*ranges, (n + 1) * sizeof(**ranges));
+		if (!more) {
+			free(*ranges);
+			*ranges = NULL;
+			return -ENOMEM;
+		}
+		*ranges = more;
+		(*ranges)[n].pos = pos;
+		(*ranges)[n++].len = erasesize;
+	}
+
+	return n;
+}
+
+/*
+ * Bring the mirror's copy of the erase block at 'pos' up to date. Blocks
+ * whose content already matches, by CRC, are only marked as in sync.
+ */
+int flash_mirror_block(struct mbox_flash *flash, uint32_t pos)
+{
+	uint32_t erasesize = flash->mtd_info.erasesize;
+	struct mbox_flash *mirror = flash->mirror;
+	uint32_t blk = pos / erasesize, gen = flash->gen[blk];
+	uint8_t *buf = flash->mirror_buf;
+	uint32_t crc, old = 0;
+	int rc;
+
+	if (mirror->gen[blk] == gen)
+		return 0;
+
+	if (!scan_index_lookup(flash, pos, &crc) ||
+			!scan_index_lookup(mirror, pos, &old) || crc != old) {
+		rc = chip_read(flash, buf, pos, erasesize);
+		if (rc)
+			return rc;
+		crc = mbox_crc32c(0, buf, erasesize);
+		scan_index_check(flash, buf, pos, erasesize);
+
+		if (!scan_index_lookup(mirror, pos, &old)) {
+			rc = chip_read(mirror, buf + erasesize, pos, erasesize);
+			if (rc)
+				return rc;
+			old = mbox_crc32c(0, buf + erasesize, erasesize);
+		}
+	}
+
+	if (crc != old) {
+		scan_index_forget(mirror, pos, erasesize);
+		rc = chip_erase(mirror, pos, erasesize);
+		if (!rc)
+			rc = chip_write(mirror, buf, pos, erasesize);
+		if (rc)
+			return rc;
+		scan_index_update(mirror, buf, pos, erasesize);
+		flash->mirror_writes++;
+	}
+	mirror->gen[blk] = gen;
+
+	return 0;
+}
+
+/*
+ * Make the mirror the primary, with every host on 'flash' moved over by
+ * the caller. Only once they're in sync and nothing is held back from the
+ * SPI by an overlay or tied to this chip by a snapshot.
+ */
+struct mbox_flash *flash_mirror_switch(struct mbox_flash *flash)
+{
+	struct mbox_flash *mirror = flash->mirror;
+	uint32_t blocks = flash->mtd_info.size / flash->mtd_info.erasesize;
+	unsigned int users;
+	uint32_t blk;
+
+	if (!mirror || flash->mirror_work || flash->overlay_blocks ||
+			flash->snap)
+		return NULL;
+	for (blk = 0; blk < blocks; blk++) {
+		if (mirror->gen[blk] != flash->gen[blk])
+			return NULL;
+	}
+
+	MSG_OUT("Switching from %s to %s\n", flash->path, mirror->path);
+	users = flash->users;
+	flash->users = mirror->users;
+	mirror->users = users;
+	mirror->gen_next = flash->gen_next;
+	mirror->mirror_stale = false;
+	flash_sync(mirror);
+
+	return mirror;
+}
+
+int copy_flash(struct mbox_context *context)
+{
+	int r;
+
+	/*
+	 * Copy flash into RAM early, same time.
+	 * The kernel has created the LPC->AHB mapping also, which means
+	 * flash should work.
+	 * Ideally we tell the kernel whats up and when to do stuff...
+	 */
+	MSG_OUT("Loading flash into ram at %p for 0x%08x bytes\n",
+		context->lpc_mem, context->size);
+	r = flash_read(context, 0, context->size);
+	if (r) {
+		MSG_ERR("Couldn't copy mtd into ram: %d\n", r);
+		return r;
+	}
+	return 0;
+}
@@ -0,0 +1,95 @@
+/* Copyright 2016 IBM
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *    http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *	Unless required by applicable law or agreed to in writing, software
+ *	distributed under the License is distributed on an "AS IS" BASIS,
+ *	WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *	See the License for the specific language governing permissions and
+ *	limitations under the License.
+ *
+ */
+
+#ifndef MBOXD_FLASH_H
+#define MBOXD_FLASH_H
+
+#include "mboxd.h"
+
+/*
+ * Flash accessors. Offsets are in bytes from the start of the MTD and the
+ * in memory copy lives at the same offset in context->lpc_mem.
+ */
+
+/* Erase block size presented for a PNOR image file */
+#define FLASH_IMAGE_ERASESIZE (64 << 10)
+
+/* With --verify, pages that read back wrong are tried again this often */
+#define FLASH_VERIFY_PAGE 256
+#define FLASH_VERIFY_RETRIES 3
+
+struct mbox_flash *flash_get(const char *path);
+
+void flash_put(struct mbox_flash *flash);
+
+int flash_sync(struct mbox_flash *flash);
+
+void flash_cache_drop(struct mbox_flash *flash);
+
+void flash_cache_invalidate(struct mbox_flash *flash, uint32_t pos,
+		uint32_t len);
+
+int flash_read_raw(struct mbox_flash *flash, void *buf, uint32_t pos,
+		uint32_t len);
+
+int flash_read_buf(struct mbox_context *context, void *buf, uint32_t pos,
+		uint32_t len);
+
+int flash_read(struct mbox_context *context, uint32_t pos, uint32_t len);
+
+int flash_overlay_policy(const char *spec);
+
+int flash_overlay_range(uint32_t pos, uint32_t len);
+
+bool flash_overlay_has(struct mbox_flash *flash, uint32_t pos);
+
+bool flash_overlaid(struct mbox_flash *flash, uint32_t pos);
+
+int flash_overlay_write(struct mbox_context *context, uint32_t pos,
+		uint32_t len);
+
+int flash_overlay_write_buf(struct mbox_context *context, const void *buf,
+		uint32_t pos, uint32_t len);
+
+int flash_overlay_flatten(struct mbox_context *context, uint32_t pos,
+		uint32_t len);
+
+int flash_mirror(struct mbox_flash *flash, const char *path);
+
+bool flash_mirror_synced(struct mbox_flash *flash, uint32_t pos);
+
+int flash_mirror_ranges(struct mbox_flash *flash, struct mbox_range **ranges);
+
+int flash_mirror_block(struct mbox_flash *flash, uint32_t pos);
+
+struct mbox_flash *flash_mirror_switch(struct mbox_flash *flash);
+
+int flash_snap_create(struct mbox_flash *flash);
+
+struct mbox_flash_snap *flash_snap_detach(struct mbox_flash *flash);
+
+void flash_snap_free(struct mbox_flash *flash, struct mbox_flash_snap *snap);
+
+int flash_erase(struct mbox_context *context, uint32_t pos, uint32_t len);
+
+int flash_program(struct mbox_context *context, uint32_t pos, uint32_t len);
+
+int flash_program_buf(struct mbox_context *context, const void *buf,
+		uint32_t pos, uint32_t len);
+
+int copy_flash(struct mbox_context *context);
+
+#endif /* MBOXD_FLASH_H */
@@ -0,0 +1,189 @@
+/* Copyright 2016 IBM
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *    http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *	Unless required by applicable law or agreed to in writing, software
+ *	distributed under the License is distributed on an "AS IS" BASIS,
+ *	WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *	See the License for the specific language governing permissions and
+ *	limitations under the License.
+ *
+ */
+
+#define _GNU_SOURCE
+#include <errno.h>
+#include <stdarg.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <syslog.h>
+#include <sys/timerfd.h>
+#include <unistd.h>
+
+#include "mbox.h"
+#include "common.h"
+#include "mboxd_notify.h"
+#include "mboxd_regs.h"
+
+static int notify_arm(struct mbox_context *context, unsigned int ms)
+{
+	struct itimerspec spec = {
+		.it_value = {
+			.tv_sec = ms / 1000,
+			.tv_nsec = (ms % 1000) * 1000000L,
+		},
+	};
+
+	if (timerfd_settime(context->fds[NOTIFY_FD].fd, 0, &spec, NULL) < 0) {
+		MSG_ERR("Couldn't set notification timer: %s\n", strerror(errno));
+		return -errno;
+	}
+
+	return 0;
+}
+
+int notify_init(struct mbox_context *context)
+{
+	context->fds[NOTIFY_FD].fd = timerfd_create(CLOCK_MONOTONIC,
+			TFD_NONBLOCK | TFD_CLOEXEC);
+	if (context->fds[NOTIFY_FD].fd < 0) {
+		MSG_ERR("Couldn't create notification timer: %s\n",
+				strerror(errno));
+		return -errno;
+	}
+	context->fds[NOTIFY_FD].events = POLLIN;
+
+	/* Whatever the host knew about us is gone */
+	context->bmc_status = 0;
+	context->bmc_want = MBOX_BMC_EVT_REBOOT;
+	context->notify_pending = 1;
+
+	return 0;
+}
+
+static void notify_change(struct mbox_context *context, uint8_t want)
+{
+	if (want == context->bmc_want)
+		return;
+
+	context->bmc_want = want;
+	context->notify_stats.events++;
+	if (!context->notify_pending++ && context->notify_delay_ms)
+		notify_arm(context, context->notify_delay_ms);
+}
+
+void notify_event(struct mbox_context *context, uint8_t bits)
+{
+	notify_change(context, context->bmc_want | bits);
+}
+
+void notify_state(struct mbox_context *context, uint8_t bits, bool on)
+{
+	if (on)
+		notify_change(context, context->bmc_want | bits);
+	else
+		notify_change(context, context->bmc_want & ~bits);
+}
+
+/* The host can only clear bits, and only ones that are set */
+void notify_ack(struct mbox_context *context, uint8_t hw, uint8_t bits)
+{
+	context->bmc_status = hw;
+	context->bmc_want &= ~(bits & hw);
+}
+
+bool notify_dirty(struct mbox_context *context)
+{
+	return context->bmc_want != context->bmc_status;
+}
+
+uint8_t notify_status(struct mbox_context *context)
+{
+	return context->bmc_want;
+}
+
+static void notify_settle(struct mbox_context *context, uint8_t status)
+{
+	context->bmc_status = status;
+	context->notify_pending = 0;
+	if (context->notify_delay_ms)
+		notify_arm(context, 0);
+}
+
+/* The status went out with a response, which interrupts the host anyway */
+void notify_written(struct mbox_context *context, uint8_t status)
+{
+	context->notify_stats.piggybacked++;
+	context->notify_stats.suppressed += context->notify_pending;
+	notify_settle(context, status);
+}
+
+int notify_flush(struct mbox_context *context)
+{
+	uint8_t status = context->bmc_want;
+	int rc;
+
+	if (!notify_dirty(context)) {
+		context->notify_stats.suppressed += context->notify_pending;
+		notify_settle(context, status);
+		return 0;
+	}
+
+	MSG_OUT("Updating BMC status 0x%02x -> 0x%02x\n", context->bmc_status,
+			status);
+	rc = mbox_regs_write_bmc(context, status);
+	if (rc)
+		return rc;
+
+	context->notify_stats.sent++;
+	if (context->notify_pending)
+		context->notify_stats.suppressed += context->notify_pending - 1;
+	notify_settle(context, status);
+
+	return 0;
+}
+
+/* Called each trip around the poll loop, flushes once enough has built up */
+int notify_poll(struct mbox_context *context)
+{
+	if (!context->notify_pending)
+		return 0;
+
+	if (context->notify_pending < context->notify_count &&
+			context->notify_delay_ms)
+		return 0;
+
+	return notify_flush(context);
+}
+
+int notify_timeout(struct mbox_context *context)
+{
+	uint64_t expirations;
+
+	if (read(context->fds[NOTIFY_FD].fd, &expirations,
+				sizeof(expirations)) < 0 && errno != EAGAIN) {
+		MSG_ERR("Couldn't read notification timer: %s\n", strerror(errno));
+		return -errno;
+	}
+
+	return notify_flush(context);
+}
+
+void notify_free(struct mbox_context *context)
+{
+	struct mbox_notify_stats *stats = &context->notify_stats;
+
+	if (context->fds[NOTIFY_FD].fd < 0)
+		return;
+
+	MSG_OUT("Notifications: %lu changes, %lu sent, %lu with responses, %lu suppressed\n",
+			stats->events, stats->sent, stats->piggybacked,
+			stats->suppressed);
+
+	close(context->fds[NOTIFY_FD].fd);
+	context->fds[NOTIFY_FD].fd = -1;
+}
@@ -0,0 +1,53 @@
+/* Copyright 2016 IBM
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *    http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *	Unless required by applicable law or agreed to in writing, software
+ *	distributed under the License is distributed on an "AS IS" BASIS,
+ *	WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *	See the License for the specific language governing permissions and
+ *	limitations under the License.
+ *
+ */
+
+#ifndef MBOXD_NOTIFY_H
+#define MBOXD_NOTIFY_H
+
+#include "mboxd.h"
+
+/*
+ * BMC to host notifications through the BMC status byte. Events latch
+ * until the host ACKs them, states follow what the daemon is doing. Both
+ * are only collected here; the byte goes out for free with the next
+ * response, or on its own once notify_count changes have built up or
+ * notify_delay_ms has passed since the first of them. Nothing is written
+ * if the byte didn't actually change.
+ */
+
+int notify_init(struct mbox_context *context);
+
+void notify_event(struct mbox_context *context, uint8_t bits);
+
+void notify_state(struct mbox_context *context, uint8_t bits, bool on);
+
+void notify_ack(struct mbox_context *context, uint8_t hw, uint8_t bits);
+
+bool notify_dirty(struct mbox_context *context);
+
+uint8_t notify_status(struct mbox_context *context);
+
+void notify_written(struct mbox_context *context, uint8_t status);
+
+int notify_flush(struct mbox_context *context);
+
+int notify_poll(struct mbox_context *context);
+
+int notify_timeout(struct mbox_context *context);
+
+void notify_free(struct mbox_context *context);
+
+#endif /* MBOXD_NOTIFY_H */
@@ -0,0 +1,127 @@
+/* Copyright 2016 IBM
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *    http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *	Unless required by applicable law or agreed to in writing, software
+ *	distributed under the License is distributed on an "AS IS" BASIS,
+ *	WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *	See the License for the specific language governing permissions and
+ *	limitations under the License.
+ *
+ */
+
+#define _GNU_SOURCE
+#include <errno.h>
+#include <stdarg.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <syslog.h>
+#include <unistd.h>
+
+#include "common.h"
+#include "mboxd_regs.h"
+
+static ssize_t regs_pread(struct mbox_context *context, void *buf,
+		size_t len, off_t off)
+{
+	context->regs_stats.syscalls++;
+	return pread(context->fds[MBOX_FD].fd, buf, len, off);
+}
+
+static ssize_t regs_pwrite(struct mbox_context *context, const void *buf,
+		size_t len, off_t off)
+{
+	context->regs_stats.syscalls++;
+	return pwrite(context->fds[MBOX_FD].fd, buf, len, off);
+}
+
+void mbox_regs_begin(struct mbox_context *context)
+{
+	context->regs_stats.syscalls = 0;
+}
+
+void mbox_regs_end(struct mbox_context *context)
+{
+	struct mbox_regs_stats *stats = &context->regs_stats;
+
+	stats->commands++;
+	stats->total_syscalls += stats->syscalls;
+	if (stats->syscalls > stats->max_syscalls)
+		stats->max_syscalls = stats->syscalls;
+
+	if (verbosity == MBOX_LOG_DEBUG)
+		MSG_OUT("Command took %u register syscalls (max %u, avg %lu.%02lu)\n",
+			stats->syscalls, stats->max_syscalls,
+			stats->total_syscalls / stats->commands,
+			(stats->total_syscalls * 100 / stats->commands) % 100);
+}
+
+int mbox_regs_read(struct mbox_context *context, union mbox_regs *req)
+{
+	ssize_t len;
+
+	len = regs_pread(context, req->raw, sizeof(req->raw), 0);
+	if (len < 0) {
+		MSG_ERR("Couldn't read: %s\n", strerror(errno));
+		return -errno;
+	}
+	if (len < (ssize_t)sizeof(req->msg)) {
+		MSG_ERR("Short read: %zd expecting %zu\n", len, sizeof(req->msg));
+		return -EIO;
+	}
+
+	return 0;
+}
+
+int mbox_regs_write_bmc(struct mbox_context *context, uint8_t byte)
+{
+	if (regs_pwrite(context, &byte, 1, MBOX_BMC_BYTE) != 1) {
+		MSG_ERR("Couldn't write to BMC status reg: %s\n", strerror(errno));
+		return -errno;
+	}
+
+	return 0;
+}
+
+/*
+ * Write a response back to the host. The last two 'status' bytes are only
+ * touched if set_bmc is true, in which case resp->raw[MBOX_BMC_BYTE] holds
+ * the new BMC status value and the lot goes out as one write, so that a
+ * command costs no more than the read and this. That includes
+ * MBOX_HOST_BYTE, which has to be what was read at the start of the
+ * command.
+ */
+int mbox_regs_write_resp(struct mbox_context *context, union mbox_regs *resp,
+		bool set_bmc)
+{
+	size_t want = set_bmc ? sizeof(resp->raw) : sizeof(resp->msg);
+	ssize_t len;
+
+	len = regs_pwrite(context, resp->raw, want, 0);
+	if (len < (ssize_t)want) {
+		MSG_ERR("Didn't write the full response: %s\n", strerror(errno));
+		return len < 0 ? -errno : -EIO;
+	}
+
+	return 0;
+}
+
+int mbox_regs_fill(struct mbox_context *context, uint8_t byte)
+{
+	uint8_t regs[MBOX_REG_BYTES];
+	ssize_t len;
+
+	memset(regs, byte, sizeof(regs));
+	len = regs_pwrite(context, regs, sizeof(regs), 0);
+	if (len < (ssize_t)sizeof(regs)) {
+		MSG_ERR("Couldn't write MBOX regs: %s\n", strerror(errno));
+		return len < 0 ? -errno : -EIO;
+	}
+
+	return 0;
+}
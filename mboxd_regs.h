@@ -0,0 +1,42 @@
+/* Copyright 2016 IBM
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *    http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *	Unless required by applicable law or agreed to in writing, software
+ *	distributed under the License is distributed on an "AS IS" BASIS,
+ *	WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *	See the License for the specific language governing permissions and
+ *	limitations under the License.
+ *
+ */
+
+#ifndef MBOXD_REGS_H
+#define MBOXD_REGS_H
+
+#include "mbox.h"
+#include "mboxd.h"
+
+/*
+ * All access to the mailbox registers goes through here so that each
+ * transfer is a single pread()/pwrite() at an explicit offset. The fd
+ * position is never relied upon, which saves the lseek() round trips.
+ */
+
+void mbox_regs_begin(struct mbox_context *context);
+
+void mbox_regs_end(struct mbox_context *context);
+
+int mbox_regs_read(struct mbox_context *context, union mbox_regs *req);
+
+int mbox_regs_write_resp(struct mbox_context *context, union mbox_regs *resp,
+		bool set_bmc);
+
+int mbox_regs_write_bmc(struct mbox_context *context, uint8_t byte);
+
+int mbox_regs_fill(struct mbox_context *context, uint8_t byte);
+
+#endif /* MBOXD_REGS_H */
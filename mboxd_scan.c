@@ -0,0 +1,345 @@
+/* Copyright 2016 IBM
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *    http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *	Unless required by applicable law or agreed to in writing, software
+ *	distributed under the License is distributed on an "AS IS" BASIS,
+ *	WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *	See the License for the specific language governing permissions and
+ *	limitations under the License.
+ *
+ */
+
+#define _GNU_SOURCE
+#include <errno.h>
+#include <fcntl.h>
+#include <inttypes.h>
+#include <stdarg.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <syslog.h>
+#include <unistd.h>
+
+#include "mbox.h"
+#include "common.h"
+#include "mboxd.h"
+#include "mboxd_flash.h"
+#include "mboxd_scan.h"
+#include "mboxd_sched.h"
+
+/* Index file layout: the header, a CRC per erase block, a known bitmap */
+#define INDEX_MAGIC "MBOXIDX1"
+
+struct index_hdr {
+	char magic[8];
+	uint32_t erasesize;
+	uint32_t blocks;
+} __attribute__((packed));
+
+/* Where to persist the index of every flash opened, NULL for nowhere */
+static const char *index_policy;
+
+int scan_index_policy(const char *path)
+{
+	index_policy = path;
+
+	return 0;
+}
+
+static uint32_t scan_nblocks(struct mbox_flash *flash)
+{
+	return flash->mtd_info.size / flash->mtd_info.erasesize;
+}
+
+static bool scan_known(struct mbox_flash *flash, uint32_t blk)
+{
+	return flash->crc_known[blk / 8] & (1 << (blk % 8));
+}
+
+static void scan_index_load(struct mbox_flash *flash)
+{
+	uint32_t blocks = scan_nblocks(flash);
+	size_t map = (blocks + 7) / 8;
+	struct index_hdr hdr;
+	uint32_t blk, known = 0;
+	int fd;
+
+	fd = open(flash->index_path, O_RDONLY | O_CLOEXEC);
+	if (fd < 0) {
+		if (errno != ENOENT)
+			MSG_ERR("Couldn't open block index %s: %s\n",
+					flash->index_path, strerror(errno));
+		return;
+	}
+
+	if (read(fd, &hdr, sizeof(hdr)) != sizeof(hdr) ||
+			memcmp(hdr.magic, INDEX_MAGIC, sizeof(hdr.magic)) ||
+			hdr.erasesize != flash->mtd_info.erasesize ||
+			hdr.blocks != blocks ||
+			read(fd, flash->crc, blocks * sizeof(*flash->crc)) !=
+				(ssize_t)(blocks * sizeof(*flash->crc)) ||
+			read(fd, flash->crc_known, map) != (ssize_t)map) {
+		MSG_ERR("Block index %s isn't for this flash, starting afresh\n",
+				flash->index_path);
+		memset(flash->crc_known, 0, map);
+		close(fd);
+		return;
+	}
+	close(fd);
+
+	for (blk = 0; blk < blocks; blk++)
+		known += scan_known(flash, blk);
+	MSG_OUT("Loaded block index %s, %u of %u erase blocks known\n",
+			flash->index_path, known, blocks);
+}
+
+/*
+ * Set up the index of a flash as it's opened, before a journal replay or
+ * anything else programs it
+ */
+int scan_index_init(struct mbox_flash *flash)
+{
+	uint32_t blocks = scan_nblocks(flash);
+	const char *mtd;
+
+	flash->crc = calloc(blocks, sizeof(*flash->crc));
+	flash->crc_known = calloc((blocks + 7) / 8, 1);
+	if (!flash->crc || !flash->crc_known)
+		return -ENOMEM;
+	sched_client_init(&flash->scan_client, "scan");
+
+	if (!index_policy)
+		return 0;
+
+	mtd = strrchr(flash->path, '/');
+	if (asprintf(&flash->index_path, "%s.%s", index_policy,
+				mtd ? mtd + 1 : flash->path) < 0) {
+		flash->index_path = NULL;
+		return -ENOMEM;
+	}
+	scan_index_load(flash);
+
+	return 0;
+}
+
+/* The CRC32C of the erase block at 'pos', if known */
+bool scan_index_lookup(struct mbox_flash *flash, uint32_t pos, uint32_t *crc)
+{
+	uint32_t blk = pos / flash->mtd_info.erasesize;
+
+	if (!scan_known(flash, blk))
+		return false;
+
+	*crc = flash->crc[blk];
+
+	return true;
+}
+
+/*
+ * 'buf' was just read from [pos, pos + len) of the flash: report any whole
+ * erase block that isn't what the index says was last programmed. The
+ * index is left for a scan to confirm and reload.
+ */
+void scan_index_check(struct mbox_flash *flash, const uint8_t *buf,
+		uint32_t pos, uint32_t len)
+{
+	uint32_t erasesize = flash->mtd_info.erasesize;
+	uint32_t off, blk;
+
+	if (!flash->crc)
+		return;
+
+	for (off = ALIGN_UP(pos, erasesize); off + erasesize <= pos + len;
+			off += erasesize) {
+		blk = off / erasesize;
+		if (!scan_known(flash, blk) || flash->crc[blk] ==
+				mbox_crc32c(0, buf + off - pos, erasesize))
+			continue;
+		MSG_ERR("Erase block 0x%08x of %s changed behind our back\n",
+				off, flash->path);
+		flash->scan_stats.drifted++;
+	}
+}
+
+/* [pos, pos + len) is now 'buf' on flash */
+void scan_index_update(struct mbox_flash *flash, const uint8_t *buf,
+		uint32_t pos, uint32_t len)
+{
+	uint32_t erasesize = flash->mtd_info.erasesize;
+	uint32_t off, blk;
+
+	if (!flash->crc)
+		return;
+
+	/* Part of a block says nothing about the rest of it */
+	scan_index_forget(flash, pos, len);
+	for (off = ALIGN_UP(pos, erasesize); off + erasesize <= pos + len;
+			off += erasesize) {
+		blk = off / erasesize;
+		flash->crc[blk] = mbox_crc32c(0, buf + off - pos, erasesize);
+		flash->crc_known[blk / 8] |= 1 << (blk % 8);
+	}
+}
+
+void scan_index_forget(struct mbox_flash *flash, uint32_t pos, uint32_t len)
+{
+	uint32_t erasesize = flash->mtd_info.erasesize;
+	uint32_t off, blk;
+
+	if (!flash->crc)
+		return;
+
+	for (off = pos & ~(erasesize - 1); off < pos + len; off += erasesize) {
+		blk = off / erasesize;
+		flash->crc_known[blk / 8] &= ~(1 << (blk % 8));
+	}
+	flash->index_dirty = true;
+}
+
+/* Replace the index file as a whole, so a crash leaves the old one */
+int scan_index_save(struct mbox_flash *flash)
+{
+	uint32_t blocks = scan_nblocks(flash);
+	struct index_hdr hdr = {
+		.magic = INDEX_MAGIC,
+		.erasesize = flash->mtd_info.erasesize,
+		.blocks = blocks,
+	};
+	size_t map = (blocks + 7) / 8;
+	char *tmp;
+	int fd, rc = 0;
+
+	if (!flash->index_path || !flash->index_dirty)
+		return 0;
+
+	if (asprintf(&tmp, "%s.tmp", flash->index_path) < 0)
+		return -ENOMEM;
+
+	fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC,
+			S_IRUSR | S_IWUSR);
+	if (fd < 0 ||
+			write(fd, &hdr, sizeof(hdr)) != sizeof(hdr) ||
+			write(fd, flash->crc, blocks * sizeof(*flash->crc)) !=
+				(ssize_t)(blocks * sizeof(*flash->crc)) ||
+			write(fd, flash->crc_known, map) != (ssize_t)map ||
+			fsync(fd) < 0 || rename(tmp, flash->index_path) < 0) {
+		rc = -errno;
+		MSG_ERR("Couldn't save block index %s: %s\n",
+				flash->index_path, strerror(errno));
+		unlink(tmp);
+	} else {
+		flash->index_dirty = false;
+	}
+	if (fd >= 0)
+		close(fd);
+	free(tmp);
+
+	return rc;
+}
+
+static void scan_done(struct mbox_context *context, struct mbox_work *work,
+		void *priv)
+{
+	struct mbox_flash *flash = priv;
+
+	flash->scan_work = NULL;
+	flash->scan_stats.scans++;
+	flash->scan_stats.last_ns = mbox_clock_ns() - work->submitted;
+	MSG_OUT("Scanned %s in %"PRIu64"ms, %lu erase blocks changed behind our back%s%s\n",
+			flash->path, flash->scan_stats.last_ns / 1000000,
+			flash->scan_stats.last_drifted,
+			work->rc ? ", stopped early: " : "",
+			work->rc ? strerror(-work->rc) : "");
+	scan_index_save(flash);
+}
+
+/*
+ * Queue a scan of the whole of the host's flash, as background work for
+ * 'client' or the flash's own.
+ */
+int scan_start(struct mbox_context *context, struct mbox_client *client)
+{
+	struct mbox_flash *flash = context->flash;
+	struct mbox_work *work;
+
+	if (flash->scan_work)
+		return -EBUSY;
+
+	work = sched_submit(context, MBOX_SCHED_SCRUB, 0, mbox_clock_ns(), 0,
+			flash->mtd_info.size);
+	if (!work)
+		return -ENOMEM;
+	work->scan = true;
+	sched_attribute(work, client ? client : &flash->scan_client);
+	sched_on_complete(work, scan_done, flash);
+	flash->scan_work = work;
+	flash->scan_stats.last_drifted = 0;
+	MSG_OUT("Scanning %s\n", flash->path);
+
+	return 0;
+}
+
+/* Compare [pos, pos + len), whole erase blocks, against the index */
+int scan_block(struct mbox_context *context, uint32_t pos, uint32_t len)
+{
+	struct mbox_flash *flash = context->flash;
+	uint32_t erasesize = flash->mtd_info.erasesize;
+	struct mbox_work *work;
+	uint32_t off, blk, crc;
+	int rc;
+
+	if (!flash->scan_buf) {
+		flash->scan_buf = malloc(erasesize);
+		if (!flash->scan_buf)
+			return -ENOMEM;
+	}
+
+	for (off = pos; off < pos + len; off += erasesize) {
+		rc = flash_read_raw(flash, flash->scan_buf, off, erasesize);
+		if (rc)
+			return rc;
+
+		blk = off / erasesize;
+		crc = mbox_crc32c(0, flash->scan_buf, erasesize);
+		flash->scan_stats.blocks++;
+		if (scan_known(flash, blk) && flash->crc[blk] == crc)
+			continue;
+
+		if (scan_known(flash, blk)) {
+			MSG_ERR("Erase block 0x%08x of %s changed behind our back, reloading\n",
+					off, flash->path);
+			flash->scan_stats.drifted++;
+			flash->scan_stats.last_drifted++;
+			flash_cache_invalidate(flash, off, erasesize);
+			if (off < context->size) {
+				work = sched_submit(context,
+						MBOX_SCHED_PREFETCH, 0,
+						mbox_clock_ns(), off,
+						erasesize);
+				if (work)
+					sched_attribute(work,
+							&flash->scan_client);
+			}
+		}
+		flash->crc[blk] = crc;
+		flash->crc_known[blk / 8] |= 1 << (blk % 8);
+		flash->index_dirty = true;
+	}
+
+	return 0;
+}
+
+void scan_free(struct mbox_flash *flash)
+{
+	scan_index_save(flash);
+	free(flash->crc);
+	free(flash->crc_known);
+	free(flash->index_path);
+	free(flash->scan_buf);
+}
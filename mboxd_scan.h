@@ -0,0 +1,57 @@
+/* Copyright 2016 IBM
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *    http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *	Unless required by applicable law or agreed to in writing, software
+ *	distributed under the License is distributed on an "AS IS" BASIS,
+ *	WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *	See the License for the specific language governing permissions and
+ *	limitations under the License.
+ *
+ */
+
+#ifndef MBOXD_SCAN_H
+#define MBOXD_SCAN_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "mboxd.h"
+
+/*
+ * Integrity scan. A CRC32C of every erase block is kept in an index,
+ * updated as mboxd programs the flash and optionally persisted across
+ * restarts (--index). A scan reads the whole flash in the background and
+ * compares it against the index: a block that differs was changed by
+ * something other than mboxd, or has drifted, and is reloaded. Reads of
+ * the flash are checked against the index too, but only the scan and
+ * programs change it.
+ */
+
+int scan_index_policy(const char *path);
+
+int scan_index_init(struct mbox_flash *flash);
+
+bool scan_index_lookup(struct mbox_flash *flash, uint32_t pos, uint32_t *crc);
+
+void scan_index_update(struct mbox_flash *flash, const uint8_t *buf,
+		uint32_t pos, uint32_t len);
+
+void scan_index_check(struct mbox_flash *flash, const uint8_t *buf,
+		uint32_t pos, uint32_t len);
+
+void scan_index_forget(struct mbox_flash *flash, uint32_t pos, uint32_t len);
+
+int scan_index_save(struct mbox_flash *flash);
+
+int scan_start(struct mbox_context *context, struct mbox_client *client);
+
+int scan_block(struct mbox_context *context, uint32_t pos, uint32_t len);
+
+void scan_free(struct mbox_flash *flash);
+
+#endif /* MBOXD_SCAN_H */
@@ -0,0 +1,943 @@
+/* Copyright 2016 IBM
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *    http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *	Unless required by applicable law or agreed to in writing, software
+ *	distributed under the License is distributed on an "AS IS" BASIS,
+ *	WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *	See the License for the specific language governing permissions and
+ *	limitations under the License.
+ *
+ */
+
+#define _GNU_SOURCE
+#include <assert.h>
+#include <inttypes.h>
+#include <errno.h>
+#include <stdarg.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <syslog.h>
+
+#include "mbox.h"
+#include "common.h"
+#include "mboxd.h"
+#include "mboxd_ecc.h"
+#include "mboxd_flash.h"
+#include "mboxd_notify.h"
+#include "mboxd_scan.h"
+#include "mboxd_sched.h"
+#include "mboxd_txn.h"
+#include "mboxd_wear.h"
+
+#define NSEC_PER_SEC 1000000000ULL
+
+/* Weight of the newest sample in the step cost moving average, out of 8 */
+#define COST_WEIGHT 2
+
+static const char *class_name[MBOX_SCHED_CLASSES] = {
+	[MBOX_SCHED_DEMAND] = "demand",
+	[MBOX_SCHED_PREFETCH] = "prefetch",
+	[MBOX_SCHED_FLUSH] = "flush",
+	[MBOX_SCHED_MIRROR] = "mirror",
+	[MBOX_SCHED_SCRUB] = "scrub",
+};
+
+static void sched_insert(struct mbox_context *context, struct mbox_work *work)
+{
+	struct mbox_work **pos = &context->work[work->cls];
+
+	while (*pos && (*pos)->deadline <= work->deadline)
+		pos = &(*pos)->next;
+
+	work->next = *pos;
+	*pos = work;
+}
+
+static void sched_remove(struct mbox_context *context, struct mbox_work *work)
+{
+	struct mbox_work **pos = &context->work[work->cls];
+
+	while (*pos && *pos != work)
+		pos = &(*pos)->next;
+
+	assert(*pos);
+	*pos = work->next;
+	work->next = NULL;
+}
+
+/* Virtual time of the last client served */
+static uint64_t sched_vclock;
+
+/* Every host, so that a wait on one keeps the others' work going */
+static struct mbox_context **sched_contexts;
+static int sched_n;
+
+void sched_hosts(struct mbox_context **contexts, int n)
+{
+	sched_contexts = contexts;
+	sched_n = n;
+}
+
+void sched_client_init(struct mbox_client *client, const char *name)
+{
+	uint64_t budget = client->budget_ns;
+	unsigned int weight = client->weight;
+
+	memset(client, 0, sizeof(*client));
+	client->name = name;
+	client->weight = weight ? weight : MBOX_CLIENT_WEIGHT_DEFAULT;
+	client->budget_ns = budget;
+}
+
+/* The client's statistics on one line, as snprintf() */
+int sched_client_print(struct mbox_client *client, char *buf, size_t size)
+{
+	unsigned long works = client->stats.works ? client->stats.works : 1;
+
+	return snprintf(buf, size,
+			"Client %s: weight %u, %lu reads, %lu erases, "
+			"%lu programs, %lu overlay writes, %lu mirrored, "
+			"%llu bytes, %"PRIu64"ms busy, %lu works, "
+			"avg latency %"PRIu64"us, max %"PRIu64"us, "
+			"throttled %lu times\n",
+			client->name, client->weight,
+			client->stats.ops[MBOX_OP_READ],
+			client->stats.ops[MBOX_OP_ERASE],
+			client->stats.ops[MBOX_OP_PROGRAM],
+			client->stats.ops[MBOX_OP_OVERLAY],
+			client->stats.ops[MBOX_OP_MIRROR],
+			client->stats.bytes, client->stats.busy_ns / 1000000,
+			client->stats.works,
+			client->stats.latency_ns / works / 1000,
+			client->stats.max_latency_ns / 1000,
+			client->stats.throttled);
+}
+
+void sched_client_dump(struct mbox_client *client)
+{
+	char buf[256];
+
+	sched_client_print(client, buf, sizeof(buf));
+	MSG_OUT("%s", buf);
+}
+
+static void client_activate(struct mbox_client *client)
+{
+	/* Idle clients don't get to bank credit */
+	if (!client->pending++ && client->vtime < sched_vclock)
+		client->vtime = sched_vclock;
+}
+
+/* Hand work over to another client, eg a BMC side tool acting on a host */
+void sched_attribute(struct mbox_work *work, struct mbox_client *client)
+{
+	work->client->pending--;
+	work->client = client;
+	client_activate(client);
+}
+
+void sched_on_complete(struct mbox_work *work,
+		void (*complete)(struct mbox_context *context,
+			struct mbox_work *work, void *priv), void *priv)
+{
+	work->complete = complete;
+	work->priv = priv;
+}
+
+static void sched_work_free(struct mbox_work *work)
+{
+	free(work->map);
+	free(work->buf);
+	free(work);
+}
+
+struct mbox_work *sched_submit(struct mbox_context *context,
+		enum mbox_sched_class cls, uint8_t seq, uint64_t arrived,
+		uint32_t pos, uint32_t len)
+{
+	uint32_t erasesize = context->flash->mtd_info.erasesize;
+	struct mbox_work *work;
+
+	work = calloc(1, sizeof(*work));
+	if (!work)
+		return NULL;
+
+	work->cls = cls;
+	work->seq = seq;
+	work->client = &context->client;
+	work->submitted = mbox_clock_ns();
+	work->deadline = arrived + MBOX_HOST_TIMEOUT_SEC * NSEC_PER_SEC;
+	work->pos = pos & ~(erasesize - 1);
+	work->len = ALIGN_UP(pos + len, erasesize) - work->pos;
+
+	client_activate(work->client);
+	sched_insert(context, work);
+	if (cls == MBOX_SCHED_FLUSH)
+		notify_state(context, MBOX_BMC_EVT_FLASH_BUSY, true);
+
+	return work;
+}
+
+/* Is the erase block at 'off' into the work part of it */
+static bool work_covers(struct mbox_context *context, struct mbox_work *work,
+		uint32_t off)
+{
+	uint32_t blk = off / context->flash->mtd_info.erasesize;
+
+	if (!work->map)
+		return true;
+
+	return work->map[blk / 8] & (1 << (blk % 8));
+}
+
+/* Move past erase blocks that aren't part of a sparse work */
+static void sched_skip(struct mbox_context *context, struct mbox_work *work)
+{
+	while (work->done < work->len && !work_covers(context, work, work->done))
+		work->done += context->flash->mtd_info.erasesize;
+}
+
+/*
+ * Submit work for a set of ranges as one item, so that the host gets a
+ * single completion for them. Overlapping and adjacent ranges merge as the
+ * blocks are recorded in a bitmap and each erase block is only visited once.
+ */
+struct mbox_work *sched_submit_ranges(struct mbox_context *context,
+		enum mbox_sched_class cls, uint8_t seq, uint64_t arrived,
+		const struct mbox_range *ranges, int n)
+{
+	uint32_t erasesize = context->flash->mtd_info.erasesize;
+	uint32_t start = UINT32_MAX, end = 0, off, blk;
+	struct mbox_work *work;
+	int i;
+
+	assert(n > 0);
+
+	for (i = 0; i < n; i++) {
+		if (ranges[i].pos < start)
+			start = ranges[i].pos;
+		if (ranges[i].pos + ranges[i].len > end)
+			end = ranges[i].pos + ranges[i].len;
+	}
+
+	work = calloc(1, sizeof(*work));
+	if (!work)
+		return NULL;
+
+	work->cls = cls;
+	work->seq = seq;
+	work->client = &context->client;
+	work->submitted = mbox_clock_ns();
+	work->deadline = arrived + MBOX_HOST_TIMEOUT_SEC * NSEC_PER_SEC;
+	work->pos = start & ~(erasesize - 1);
+	work->len = ALIGN_UP(end, erasesize) - work->pos;
+	work->map = calloc((work->len / erasesize + 7) / 8, 1);
+	if (!work->map) {
+		free(work);
+		return NULL;
+	}
+
+	for (i = 0; i < n; i++) {
+		off = (ranges[i].pos & ~(erasesize - 1)) - work->pos;
+		for (; off < ranges[i].pos + ranges[i].len - work->pos;
+				off += erasesize) {
+			blk = off / erasesize;
+			work->map[blk / 8] |= 1 << (blk % 8);
+		}
+	}
+
+	client_activate(work->client);
+	sched_insert(context, work);
+	if (cls == MBOX_SCHED_FLUSH)
+		notify_state(context, MBOX_BMC_EVT_FLASH_BUSY, true);
+
+	return work;
+}
+
+/* Move queued work to another class, eg a prefetch the host now needs */
+void sched_promote(struct mbox_context *context, struct mbox_work *work,
+		enum mbox_sched_class cls, uint8_t seq, uint64_t arrived)
+{
+	sched_remove(context, work);
+	work->cls = cls;
+	work->seq = seq;
+	work->deadline = arrived + MBOX_HOST_TIMEOUT_SEC * NSEC_PER_SEC;
+	sched_insert(context, work);
+}
+
+/*
+ * lpc_mem holds newer data than the flash for anything with a flush still
+ * outstanding or staged for one, a fill must not clobber it.
+ */
+bool sched_flush_pending(struct mbox_context *context, uint32_t pos,
+		uint32_t len)
+{
+	uint32_t erasesize = context->flash->mtd_info.erasesize;
+	struct mbox_work *work;
+	uint32_t off, end;
+
+	if (txn_staged(context, pos, len))
+		return true;
+
+	for (work = context->work[MBOX_SCHED_FLUSH]; work; work = work->next) {
+		if (pos >= work->pos + work->len || work->pos + work->done >= pos + len)
+			continue;
+		if (!work->map)
+			return true;
+
+		off = work->done;
+		if (pos > work->pos + off)
+			off = (pos & ~(erasesize - 1)) - work->pos;
+		end = pos + len - work->pos;
+		if (end > work->len)
+			end = work->len;
+		for (; off < end; off += erasesize) {
+			if (work_covers(context, work, off))
+				return true;
+		}
+	}
+
+	return false;
+}
+
+static struct mbox_work *sched_next(struct mbox_context *context)
+{
+	int i;
+
+	for (i = 0; i < MBOX_SCHED_CLASSES; i++) {
+		if (context->work[i])
+			return context->work[i];
+	}
+
+	return NULL;
+}
+
+static enum mbox_sched_op sched_op(struct mbox_context *context,
+		struct mbox_work *work)
+{
+	if (work->cls == MBOX_SCHED_MIRROR)
+		return MBOX_OP_MIRROR;
+	if (work->cls != MBOX_SCHED_FLUSH)
+		return MBOX_OP_READ;
+	if (!work->flatten &&
+			flash_overlaid(context->flash, work->pos + work->done))
+		return MBOX_OP_OVERLAY;
+
+	return work->erased ? MBOX_OP_PROGRAM : MBOX_OP_ERASE;
+}
+
+/*
+ * Call 'drained' once the host has no more work of class 'cls', with the
+ * first error of whatever of it completes meanwhile. False, and nothing is
+ * called, if there's none queued now. One waiter per host and class.
+ */
+bool sched_on_drain(struct mbox_context *context, enum mbox_sched_class cls,
+		void (*drained)(struct mbox_context *context, int rc,
+			void *priv), void *priv)
+{
+	struct mbox_drain *drain = &context->drain[cls];
+
+	if (!context->work[cls])
+		return false;
+
+	assert(!drain->drained);
+	drain->drained = drained;
+	drain->priv = priv;
+	drain->rc = 0;
+
+	return true;
+}
+
+static void sched_drained(struct mbox_context *context,
+		enum mbox_sched_class cls)
+{
+	struct mbox_drain drain = context->drain[cls];
+
+	if (!drain.drained || context->work[cls])
+		return;
+
+	memset(&context->drain[cls], 0, sizeof(context->drain[cls]));
+	drain.drained(context, drain.rc, drain.priv);
+}
+
+static void sched_complete(struct mbox_context *context, struct mbox_work *work)
+{
+	struct mbox_client *client = work->client;
+	uint64_t latency = mbox_clock_ns() - work->submitted;
+	struct mbox_drain *drain = &context->drain[work->cls];
+
+	sched_remove(context, work);
+	if (drain->drained && work->rc && !drain->rc)
+		drain->rc = work->rc;
+
+	client->pending--;
+	client->stats.works++;
+	client->stats.latency_ns += latency;
+	if (latency > client->stats.max_latency_ns)
+		client->stats.max_latency_ns = latency;
+
+	if (!context->work[MBOX_SCHED_FLUSH])
+		notify_state(context, MBOX_BMC_EVT_FLASH_BUSY, false);
+
+	if (work->cls == MBOX_SCHED_PREFETCH || work->cls == MBOX_SCHED_DEMAND)
+		notify_state(context, MBOX_BMC_EVT_CACHE_READY, !work->rc);
+
+	if (work == context->prefetch)
+		context->prefetch = NULL;
+
+	/* Whatever of the window wasn't read is stale, fill it again */
+	if (work->fill)
+		context->fill_failed = work->rc != 0;
+
+	if (work->complete)
+		work->complete(context, work, work->priv);
+
+	sched_drained(context, work->cls);
+
+	if (work->waited)
+		return;
+
+	if (work->rc && work->rc != -ECANCELED)
+		MSG_ERR("Background %s work failed: %s\n",
+				class_name[work->cls], strerror(-work->rc));
+
+	if (work->async) {
+		MSG_OUT("Background work for seq %d complete\n", work->seq);
+		/* A host that never asks can't be allowed to grow this forever */
+		if (context->n_completed == sizeof(context->completed)) {
+			memmove(context->completed, context->completed + 1,
+					--context->n_completed);
+		}
+		context->completed[context->n_completed++] = work->seq;
+		notify_event(context, MBOX_BMC_EVT_COMPLETE);
+	}
+
+	sched_work_free(work);
+}
+
+/* Give up on what's left of queued 'work', completing it with -ECANCELED */
+void sched_cancel(struct mbox_context *context, struct mbox_work *work)
+{
+	work->rc = -ECANCELED;
+	work->done = work->len;
+	sched_complete(context, work);
+}
+
+static int sched_scrub(struct mbox_context *context, uint32_t pos,
+		uint32_t len)
+{
+	int rc;
+
+	if (!context->scrub_buf) {
+		context->scrub_buf = malloc(context->flash->mtd_info.erasesize);
+		if (!context->scrub_buf)
+			return -ENOMEM;
+	}
+
+	rc = flash_read_buf(context, context->scrub_buf, pos, len);
+	if (rc)
+		return rc;
+	/* The window holds corrected data, compare like with like */
+	ecc_check_buf(context, context->scrub_buf, pos, len);
+
+	context->scrub_stats.blocks++;
+	/* lpc_mem may hold host writes that aren't on the flash yet */
+	if (context->writing || context->txn_blocks ||
+			sched_flush_pending(context, pos, len) ||
+			!memcmp(context->scrub_buf, context->lpc_mem + pos, len))
+		return 0;
+
+	MSG_ERR("Flash at 0x%08x doesn't match what was loaded, refreshing\n",
+			pos);
+	memcpy(context->lpc_mem + pos, context->scrub_buf, len);
+	context->scrub_stats.refreshed++;
+
+	return 0;
+}
+
+static void scrub_done(struct mbox_context *context, struct mbox_work *work,
+		void *priv)
+{
+	if (!work->rc)
+		return;
+
+	context->scrub_stats.errors++;
+	MSG_ERR("Host %u: couldn't read back 0x%08x: %s\n", context->id,
+			work->pos, strerror(-work->rc));
+}
+
+/* Queue a scrub of the next erase block of the window, wrapping around */
+static int sched_scrub_next(struct mbox_context *context, uint64_t now)
+{
+	uint32_t len = context->flash->mtd_info.erasesize;
+	struct mbox_work *work;
+
+	if (len > context->size - context->scrub_pos)
+		len = context->size - context->scrub_pos;
+
+	work = sched_submit(context, MBOX_SCHED_SCRUB, 0, now,
+			context->scrub_pos, len);
+	if (!work)
+		return -ENOMEM;
+	sched_attribute(work, &context->scrub_client);
+	sched_on_complete(work, scrub_done, NULL);
+
+	context->scrub_pos += len;
+	if (context->scrub_pos >= context->size) {
+		context->scrub_pos = 0;
+		context->scrub_stats.passes++;
+	}
+	context->scrub_next = now + len * 1000000000ULL / context->scrub_rate;
+
+	return 0;
+}
+
+static void sched_charge(struct mbox_client *client, enum mbox_sched_op op,
+		uint32_t len, uint64_t start, uint64_t cost)
+{
+	client->stats.ops[op]++;
+	client->stats.bytes += len;
+	client->stats.busy_ns += cost;
+
+	client->vtime += cost / client->weight;
+	sched_vclock = client->vtime;
+
+	if (start - client->period_start >= MBOX_CLIENT_PERIOD_NS) {
+		client->period_start = start;
+		client->period_used = 0;
+	}
+	client->period_used += cost;
+}
+
+static bool client_throttled(struct mbox_client *client)
+{
+	if (!client->budget_ns)
+		return false;
+	if (mbox_clock_ns() - client->period_start >= MBOX_CLIENT_PERIOD_NS)
+		return false;
+
+	return client->period_used >= client->budget_ns;
+}
+
+/* Mirroring and scrubbing only get the flash when no host needs it */
+static bool sched_background(struct mbox_work *work)
+{
+	return work->cls == MBOX_SCHED_MIRROR || work->cls == MBOX_SCHED_SCRUB;
+}
+
+/* Should work 'a' run before work 'b' */
+static bool sched_before(struct mbox_work *a, bool a_throttled,
+		struct mbox_work *b, bool b_throttled)
+{
+	bool a_demand = a->cls == MBOX_SCHED_DEMAND;
+	bool b_demand = b->cls == MBOX_SCHED_DEMAND;
+
+	if (a_demand != b_demand)
+		return a_demand;
+	if (sched_background(a) != sched_background(b))
+		return !sched_background(a);
+	if (a_throttled != b_throttled)
+		return !a_throttled;
+	if (a->client->vtime != b->client->vtime)
+		return a->client->vtime < b->client->vtime;
+	if (a->cls != b->cls)
+		return a->cls < b->cls;
+
+	return a->deadline < b->deadline;
+}
+
+static void mirror_done(struct mbox_context *context, struct mbox_work *work,
+		void *priv)
+{
+	struct mbox_flash *flash = priv;
+
+	flash->mirror_work = NULL;
+	if (work->rc)
+		MSG_ERR("Couldn't mirror %s to %s, it's out of sync: %s\n",
+				flash->path, flash->mirror->path,
+				strerror(-work->rc));
+}
+
+/*
+ * Queue copying whatever the secondary chip is behind on, in the
+ * background. Its client keeps it from getting in the hosts' way.
+ */
+void sched_mirror(struct mbox_context *context)
+{
+	struct mbox_flash *flash = context->flash;
+	struct mbox_range *ranges;
+	struct mbox_work *work;
+	int n;
+
+	if (!flash->mirror || !flash->mirror_stale || flash->mirror_work)
+		return;
+
+	n = flash_mirror_ranges(flash, &ranges);
+	if (n <= 0) {
+		/* Try again next time if it was for want of memory */
+		flash->mirror_stale = n < 0;
+		return;
+	}
+
+	work = sched_submit_ranges(context, MBOX_SCHED_MIRROR, 0,
+			mbox_clock_ns(), ranges, n);
+	free(ranges);
+	if (!work)
+		return;
+	flash->mirror_stale = false;
+	flash->mirror_work = work;
+	sched_attribute(work, &flash->mirror_client);
+	sched_on_complete(work, mirror_done, flash);
+}
+
+static int sched_run(struct mbox_context *context, struct mbox_work *work)
+{
+	uint32_t step = context->flash->mtd_info.erasesize;
+	uint32_t pos = work->pos + work->done;
+	enum mbox_sched_op op = sched_op(context, work);
+	uint64_t start, cost;
+	int rc = 0;
+
+	if (step > work->len - work->done)
+		step = work->len - work->done;
+
+	start = mbox_clock_ns();
+	switch (op) {
+		case MBOX_OP_READ:
+			if (work->scan)
+				rc = scan_block(context, pos, step);
+			else if (work->cls == MBOX_SCHED_SCRUB)
+				rc = sched_scrub(context, pos, step);
+			else if (!sched_flush_pending(context, pos, step))
+				rc = flash_read(context, pos, step);
+			break;
+		case MBOX_OP_ERASE:
+			/* Nothing to flatten if it's since been programmed */
+			if (!work->flatten ||
+					flash_overlay_has(context->flash, pos))
+				rc = flash_erase(context, pos, step);
+			break;
+		case MBOX_OP_PROGRAM:
+			if (work->flatten)
+				rc = flash_overlay_flatten(context, pos, step);
+			else if (work->buf)
+				rc = flash_program_buf(context,
+						work->buf + pos - work->pos,
+						pos, step);
+			else
+				rc = flash_program(context, pos, step);
+			break;
+		case MBOX_OP_OVERLAY:
+			if (work->buf)
+				rc = flash_overlay_write_buf(context,
+						work->buf + pos - work->pos,
+						pos, step);
+			else
+				rc = flash_overlay_write(context, pos, step);
+			break;
+		case MBOX_OP_MIRROR:
+			rc = flash_mirror_block(context->flash, pos);
+			break;
+		default:
+			assert(0);
+	}
+	cost = mbox_clock_ns() - start;
+	sched_charge(work->client, op, step, start, cost);
+
+	context->step_cost[op] = (context->step_cost[op] * (8 - COST_WEIGHT) +
+			cost * COST_WEIGHT) / 8;
+
+	if (op == MBOX_OP_ERASE && !rc) {
+		work->erased = true;
+		return 0;
+	}
+
+	work->erased = false;
+	work->done += step;
+	if (rc) {
+		/* Give up on the rest, the host will see the error */
+		work->rc = rc;
+		work->done = work->len;
+	}
+	sched_skip(context, work);
+
+	if (work->done == work->len)
+		sched_complete(context, work);
+
+	sched_mirror(context);
+
+	return rc;
+}
+
+int sched_step(struct mbox_context *context)
+{
+	struct mbox_work *work = sched_next(context);
+
+	if (!work)
+		return 0;
+
+	return sched_run(context, work);
+}
+
+bool sched_pending(struct mbox_context *context)
+{
+	return sched_next(context) != NULL;
+}
+
+/*
+ * While the BMC has the flash a host's own work stays queued, work done on
+ * the BMC's behalf still goes ahead.
+ */
+static bool sched_runnable(struct mbox_context *context,
+		struct mbox_work *work)
+{
+	return !context->suspended || work->client != &context->client;
+}
+
+bool sched_pending_any(struct mbox_context **contexts, int n)
+{
+	struct mbox_work *work;
+	int i, cls;
+
+	for (i = 0; i < n; i++) {
+		for (cls = 0; cls < MBOX_SCHED_CLASSES; cls++) {
+			for (work = contexts[i]->work[cls]; work; work = work->next) {
+				if (sched_runnable(contexts[i], work))
+					return true;
+			}
+		}
+	}
+
+	return false;
+}
+
+/*
+ * Nothing is queued for any host: writes to an image go out to the file
+ * and wear telemetry to disk, now that they've stopped coming, rather than
+ * in the way of a host's flush. Then give hosts with a scrub rate that
+ * have been quiet for MBOX_SCRUB_QUIET_NS their next erase block to scrub,
+ * as often as the rate allows. Scrubs are a step at a time at the lowest
+ * class, so a host command that comes in meanwhile only ever waits for
+ * the block being read. Returns how long the main loop can sleep, in ms.
+ */
+int sched_idle(struct mbox_context **contexts, int n)
+{
+	uint64_t now = mbox_clock_ns();
+	uint64_t sleep = MBOX_IDLE_POLL_MS * 1000000ULL;
+	bool queued = false;
+	int i;
+
+	for (i = 0; i < n; i++) {
+		flash_sync(contexts[i]->flash);
+		wear_save(contexts[i]->flash, false);
+	}
+
+	for (i = 0; i < n; i++) {
+		struct mbox_context *context = contexts[i];
+		uint64_t due = context->scrub_next;
+
+		if (!context->scrub_rate || context->suspended)
+			continue;
+
+		if (due < context->last_command + MBOX_SCRUB_QUIET_NS)
+			due = context->last_command + MBOX_SCRUB_QUIET_NS;
+		if (due > now) {
+			if (due - now < sleep)
+				sleep = due - now;
+			continue;
+		}
+
+		if (!sched_scrub_next(context, now))
+			queued = true;
+	}
+
+	if (queued)
+		return 0;
+
+	/* Round up, waking early would only come straight back here */
+	return (sleep + 999999) / 1000000;
+}
+
+/*
+ * Pick the next step across all hosts. Window fills a host is blocked on
+ * always go first and mirroring and scrubbing always go last. Otherwise the
+ * flash goes to whichever client has had the least of it relative to its
+ * weight, with class priority and then deadline breaking ties. Clients over
+ * their budget only get the flash if nobody else wants it.
+ */
+static struct mbox_work *sched_pick(struct mbox_context **contexts, int n,
+		struct mbox_context **owner)
+{
+	struct mbox_work *work, *best = NULL;
+	bool best_throttled = true;
+	int i, cls;
+
+	for (i = 0; i < n; i++) {
+		for (cls = 0; cls < MBOX_SCHED_CLASSES; cls++) {
+			for (work = contexts[i]->work[cls]; work; work = work->next) {
+				bool throttled = client_throttled(work->client);
+
+				if (!sched_runnable(contexts[i], work))
+					continue;
+				if (best && !sched_before(work, throttled, best,
+							best_throttled))
+					continue;
+				best = work;
+				best_throttled = throttled;
+				*owner = contexts[i];
+			}
+		}
+	}
+
+	if (best && best_throttled)
+		best->client->stats.throttled++;
+
+	return best;
+}
+
+int sched_step_any(struct mbox_context **contexts, int n)
+{
+	struct mbox_context *owner;
+	struct mbox_work *work = sched_pick(contexts, n, &owner);
+
+	if (!work)
+		return 0;
+
+	return sched_run(owner, work);
+}
+
+/*
+ * The next step while 'context' waits on its own work: whatever the
+ * scheduler would pick across all hosts, so that other hosts' window fills
+ * aren't held up behind it. That can only come to nothing if the work
+ * being waited on isn't runnable, eg the host is suspended, in which case
+ * it goes ahead anyway as it always has.
+ */
+static struct mbox_work *sched_next_any(struct mbox_context *context,
+		struct mbox_context **owner)
+{
+	struct mbox_work *work = NULL;
+
+	if (sched_n)
+		work = sched_pick(sched_contexts, sched_n, owner);
+	if (!work) {
+		*owner = context;
+		work = sched_next(context);
+	}
+
+	return work;
+}
+
+/*
+ * Run everything queued for one class of a host to completion, along with
+ * whatever the scheduler picks ahead of it for any host. Returns the first
+ * error hit by that class.
+ */
+int sched_drain(struct mbox_context *context, enum mbox_sched_class cls)
+{
+	struct mbox_context *owner;
+	struct mbox_work *work;
+	int rc = 0, ret;
+	bool same;
+
+	while (context->work[cls]) {
+		work = sched_next_any(context, &owner);
+		same = owner == context && work->cls == cls;
+		ret = sched_run(owner, work);
+		if (ret && same && !rc)
+			rc = ret;
+	}
+
+	return rc;
+}
+
+static int sched_response(struct mbox_work *work)
+{
+	if (!work->rc)
+		return MBOX_R_SUCCESS;
+
+	return work->cls == MBOX_SCHED_FLUSH ? MBOX_R_WRITE_ERROR
+		: MBOX_R_SYSTEM_ERROR;
+}
+
+/*
+ * Run pending work of every host, in the order sched_step_any() would,
+ * until 'work' is done or, if allowed to defer, the next step would run
+ * past the point where the host has to be answered. Returns the mbox
+ * response code, MBOX_R_TIMEOUT meaning it will complete later.
+ */
+int sched_wait(struct mbox_context *context, struct mbox_work *work,
+		bool defer)
+{
+	uint64_t respond_by = work->deadline - MBOX_SCHED_MARGIN_NS;
+	struct mbox_context *owner;
+	struct mbox_work *next;
+	uint64_t cost;
+	int resp;
+
+	work->waited = true;
+	while (work->done < work->len) {
+		next = sched_next_any(context, &owner);
+		cost = owner->step_cost[sched_op(owner, next)];
+		if (defer && mbox_clock_ns() + cost > respond_by)
+			break;
+		sched_run(owner, next);
+	}
+
+	work->waited = false;
+	if (work->done < work->len) {
+		MSG_OUT("Seq %d won't complete in time, finishing in the background\n",
+				work->seq);
+		work->async = true;
+		return MBOX_R_TIMEOUT;
+	}
+
+	resp = sched_response(work);
+	sched_work_free(work);
+
+	return resp;
+}
+
+int sched_completed(struct mbox_context *context, uint8_t *seqs, int max)
+{
+	int n = context->n_completed < max ? context->n_completed : max;
+
+	memcpy(seqs, context->completed, n);
+	memmove(context->completed, context->completed + n,
+			context->n_completed - n);
+	context->n_completed -= n;
+
+	return n;
+}
+
+void sched_free(struct mbox_context *context)
+{
+	struct mbox_work *work;
+	int i;
+
+	for (i = 0; i < MBOX_SCHED_CLASSES; i++) {
+		while ((work = context->work[i])) {
+			context->work[i] = work->next;
+			/* The secondary is still behind, someone else can pick it up */
+			if (context->flash && context->flash->mirror_work == work) {
+				context->flash->mirror_work = NULL;
+				context->flash->mirror_stale = true;
+			}
+			if (context->flash && context->flash->scan_work == work)
+				context->flash->scan_work = NULL;
+			sched_work_free(work);
+		}
+	}
+	context->prefetch = NULL;
+	memset(context->drain, 0, sizeof(context->drain));
+
+	free(context->scrub_buf);
+	context->scrub_buf = NULL;
+}
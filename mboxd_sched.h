@@ -0,0 +1,197 @@
+/* Copyright 2016 IBM
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *    http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *	Unless required by applicable law or agreed to in writing, software
+ *	distributed under the License is distributed on an "AS IS" BASIS,
+ *	WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *	See the License for the specific language governing permissions and
+ *	limitations under the License.
+ *
+ */
+
+#ifndef MBOXD_SCHED_H
+#define MBOXD_SCHED_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+struct mbox_context;
+
+/*
+ * Flash work is broken into steps of a single erase, program or read of one
+ * erase block, so whatever is most urgent never waits behind more than one
+ * in-progress flash operation. Work sits in one queue per class, classes
+ * being served strictly in the order below and each queue earliest deadline
+ * first.
+ *
+ * Each command that needs flash work gets a deadline of
+ * MBOX_HOST_TIMEOUT_SEC from when it arrived. If it can't be finished before
+ * the host gives up on it the host is answered with MBOX_R_TIMEOUT and the
+ * work carries on in the background, its sequence number being reported
+ * through COMPLETED_COMMANDS once done.
+ */
+
+enum mbox_sched_class {
+	MBOX_SCHED_DEMAND,	/* flash -> lpc_mem, host is waiting */
+	MBOX_SCHED_PREFETCH,	/* flash -> lpc_mem, speculative */
+	MBOX_SCHED_FLUSH,	/* lpc_mem -> flash */
+	MBOX_SCHED_MIRROR,	/* flash -> secondary flash */
+	MBOX_SCHED_SCRUB,	/* flash -> compare against lpc_mem */
+	MBOX_SCHED_CLASSES
+};
+
+enum mbox_sched_op {
+	MBOX_OP_READ,
+	MBOX_OP_ERASE,
+	MBOX_OP_PROGRAM,
+	MBOX_OP_OVERLAY,	/* lpc_mem -> overlay, see --overlay */
+	MBOX_OP_MIRROR,		/* one erase block to the secondary */
+	MBOX_OPS
+};
+
+/*
+ * Anything that consumes flash time: each host, plus BMC side users. Flash
+ * time is shared between clients by weighted fair queuing, see
+ * sched_step_any(). A client with a budget gets at most that much flash
+ * time a second while anyone else wants the flash.
+ */
+struct mbox_client {
+	const char *name;
+	unsigned int weight;
+	uint64_t budget_ns;
+	/* Flash time used scaled by weight, lowest goes next */
+	uint64_t vtime;
+	uint64_t period_start;
+	uint64_t period_used;
+	unsigned int pending;
+	struct {
+		unsigned long ops[MBOX_OPS];
+		unsigned long long bytes;
+		uint64_t busy_ns;
+		unsigned long works;
+		/* Submission to completion */
+		uint64_t latency_ns;
+		uint64_t max_latency_ns;
+		unsigned long throttled;
+	} stats;
+};
+
+#define MBOX_CLIENT_WEIGHT_DEFAULT 1
+#define MBOX_CLIENT_PERIOD_NS 1000000000ULL
+
+struct mbox_work {
+	enum mbox_sched_class cls;
+	struct mbox_client *client;
+	uint64_t submitted;
+	uint8_t seq;
+	/* A command handler is blocked in sched_wait() on this */
+	bool waited;
+	/* The host has been told to look for seq in COMPLETED_COMMANDS */
+	bool async;
+	/* The current block of a flush has been erased, program it next */
+	bool erased;
+	/* A flush of the overlay to the SPI rather than of lpc_mem */
+	bool flatten;
+	/* A scrub against the block index rather than lpc_mem */
+	bool scan;
+	/* Fills the host's window, see window_fill() */
+	bool fill;
+	uint64_t deadline;
+	uint32_t pos;
+	uint32_t len;
+	uint32_t done;
+	/* Optional bitmap of the erase blocks in [pos, pos + len) to visit */
+	uint8_t *map;
+	/* Optional copy of [pos, pos + len) to flush rather than lpc_mem */
+	uint8_t *buf;
+	int rc;
+	/* Called once the work is done, before it is freed */
+	void (*complete)(struct mbox_context *context, struct mbox_work *work,
+			void *priv);
+	void *priv;
+	struct mbox_work *next;
+};
+
+struct mbox_range {
+	uint32_t pos;
+	uint32_t len;
+};
+
+/* Someone waiting for a host's queue of a class to empty */
+struct mbox_drain {
+	void (*drained)(struct mbox_context *context, int rc, void *priv);
+	void *priv;
+	/* The first error of the work done meanwhile */
+	int rc;
+};
+
+/* Stop working synchronously this long before the host times out */
+#define MBOX_SCHED_MARGIN_NS (100 * 1000 * 1000ULL)
+
+/* Only scrub hosts that have been quiet for this long */
+#define MBOX_SCRUB_QUIET_NS (500 * 1000 * 1000ULL)
+/* Longest the main loop sleeps with nothing to do */
+#define MBOX_IDLE_POLL_MS 1000
+
+struct mbox_work *sched_submit(struct mbox_context *context,
+		enum mbox_sched_class cls, uint8_t seq, uint64_t arrived,
+		uint32_t pos, uint32_t len);
+
+struct mbox_work *sched_submit_ranges(struct mbox_context *context,
+		enum mbox_sched_class cls, uint8_t seq, uint64_t arrived,
+		const struct mbox_range *ranges, int n);
+
+void sched_attribute(struct mbox_work *work, struct mbox_client *client);
+
+void sched_mirror(struct mbox_context *context);
+
+void sched_on_complete(struct mbox_work *work,
+		void (*complete)(struct mbox_context *context,
+			struct mbox_work *work, void *priv), void *priv);
+
+bool sched_on_drain(struct mbox_context *context, enum mbox_sched_class cls,
+		void (*drained)(struct mbox_context *context, int rc,
+			void *priv), void *priv);
+
+void sched_cancel(struct mbox_context *context, struct mbox_work *work);
+
+void sched_promote(struct mbox_context *context, struct mbox_work *work,
+		enum mbox_sched_class cls, uint8_t seq, uint64_t arrived);
+
+int sched_wait(struct mbox_context *context, struct mbox_work *work,
+		bool defer);
+
+int sched_step(struct mbox_context *context);
+
+bool sched_pending(struct mbox_context *context);
+
+int sched_drain(struct mbox_context *context, enum mbox_sched_class cls);
+
+bool sched_pending_any(struct mbox_context **contexts, int n);
+
+void sched_hosts(struct mbox_context **contexts, int n);
+
+int sched_step_any(struct mbox_context **contexts, int n);
+
+int sched_idle(struct mbox_context **contexts, int n);
+
+bool sched_flush_pending(struct mbox_context *context, uint32_t pos,
+		uint32_t len);
+
+int sched_completed(struct mbox_context *context, uint8_t *seqs, int max);
+
+void sched_client_init(struct mbox_client *client, const char *name);
+
+int sched_client_print(struct mbox_client *client, char *buf, size_t size);
+
+void sched_client_dump(struct mbox_client *client);
+
+void sched_free(struct mbox_context *context);
+
+#endif /* MBOXD_SCHED_H */
@@ -0,0 +1,439 @@
+/* Copyright 2016 IBM
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *    http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *	Unless required by applicable law or agreed to in writing, software
+ *	distributed under the License is distributed on an "AS IS" BASIS,
+ *	WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *	See the License for the specific language governing permissions and
+ *	limitations under the License.
+ *
+ */
+
+#define _GNU_SOURCE
+#include <errno.h>
+#include <fcntl.h>
+#include <stdarg.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <syslog.h>
+#include <unistd.h>
+
+#include "mbox.h"
+#include "common.h"
+#include "mboxd.h"
+#include "mboxd_ecc.h"
+#include "mboxd_flash.h"
+#include "mboxd_sched.h"
+#include "mboxd_txn.h"
+
+/*
+ * Journal layout: the header, an entry per erase block, then the blocks'
+ * content in the same order. Only a journal marked committed, whose
+ * entries and blocks all check out, is replayed.
+ */
+#define JOURNAL_MAGIC "MBOXJNL2"
+#define JOURNAL_OPEN 0
+#define JOURNAL_COMMITTED 1
+
+struct journal_hdr {
+	char magic[8];
+	uint32_t erasesize;
+	uint32_t count;
+	uint32_t state;
+	uint32_t reserved;
+	/* Of the entries */
+	uint64_t hash;
+} __attribute__((packed));
+
+struct journal_entry {
+	uint32_t pos;
+	uint32_t reserved;
+	uint64_t hash;
+} __attribute__((packed));
+
+static uint32_t txn_nblocks(struct mbox_context *context)
+{
+	return context->flash->mtd_info.size / context->flash->mtd_info.erasesize;
+}
+
+static bool txn_test(struct mbox_context *context, uint32_t blk)
+{
+	return context->txn_map[blk / 8] & (1 << (blk % 8));
+}
+
+int txn_init(struct mbox_context *context)
+{
+	context->journal_fd = -1;
+	if (!context->txn)
+		return 0;
+
+	context->txn_map = calloc((txn_nblocks(context) + 7) / 8, 1);
+	if (!context->txn_map)
+		return -ENOMEM;
+
+	if (!context->journal_path)
+		return 0;
+
+	context->journal_fd = open(context->journal_path,
+			O_RDWR | O_CREAT | O_CLOEXEC, S_IRUSR | S_IWUSR);
+	if (context->journal_fd < 0) {
+		MSG_ERR("Couldn't open journal %s: %s\n", context->journal_path,
+				strerror(errno));
+		return -errno;
+	}
+
+	return 0;
+}
+
+void txn_stage(struct mbox_context *context, uint32_t pos, uint32_t len)
+{
+	uint32_t erasesize = context->flash->mtd_info.erasesize;
+	uint32_t blk, end = ALIGN_UP(pos + len, erasesize) / erasesize;
+
+	for (blk = pos / erasesize; blk < end; blk++) {
+		if (txn_test(context, blk))
+			continue;
+		context->txn_map[blk / 8] |= 1 << (blk % 8);
+		context->txn_blocks++;
+	}
+}
+
+/* Is any of [pos, pos + len) waiting for a WRITE_FENCE */
+bool txn_staged(struct mbox_context *context, uint32_t pos, uint32_t len)
+{
+	uint32_t erasesize = context->flash->mtd_info.erasesize;
+	uint32_t blk, end = ALIGN_UP(pos + len, erasesize) / erasesize;
+
+	if (!context->txn_blocks)
+		return false;
+
+	for (blk = pos / erasesize; blk < end; blk++) {
+		if (txn_test(context, blk))
+			return true;
+	}
+
+	return false;
+}
+
+static int journal_pwrite(int fd, const void *buf, size_t len, off_t off)
+{
+	ssize_t rc;
+
+	while (len) {
+		rc = pwrite(fd, buf, len, off);
+		if (rc < 0)
+			return -errno;
+		buf += rc;
+		len -= rc;
+		off += rc;
+	}
+
+	return 0;
+}
+
+static int journal_pread(int fd, void *buf, size_t len, off_t off)
+{
+	ssize_t rc;
+
+	while (len) {
+		rc = pread(fd, buf, len, off);
+		if (rc < 0)
+			return -errno;
+		if (rc == 0)
+			return -ENODATA;
+		buf += rc;
+		len -= rc;
+		off += rc;
+	}
+
+	return 0;
+}
+
+static int journal_clear(struct mbox_context *context)
+{
+	if (ftruncate(context->journal_fd, 0) < 0 ||
+			fsync(context->journal_fd) < 0) {
+		MSG_ERR("Couldn't clear journal: %s\n", strerror(errno));
+		return -errno;
+	}
+
+	return 0;
+}
+
+/*
+ * Everything goes out and is synced before the header is marked
+ * committed, and that is synced before the flash is touched.
+ */
+static int journal_write(struct mbox_context *context)
+{
+	uint32_t erasesize = context->flash->mtd_info.erasesize;
+	struct journal_hdr hdr = { .magic = JOURNAL_MAGIC };
+	struct journal_entry *entries;
+	uint32_t blk, i = 0;
+	off_t data;
+	int rc;
+
+	entries = calloc(context->txn_blocks, sizeof(*entries));
+	if (!entries)
+		return -ENOMEM;
+
+	hdr.erasesize = erasesize;
+	hdr.count = context->txn_blocks;
+	hdr.state = JOURNAL_OPEN;
+	data = sizeof(hdr) + hdr.count * sizeof(*entries);
+
+	rc = journal_clear(context);
+	for (blk = 0; !rc && blk < txn_nblocks(context); blk++) {
+		if (!txn_test(context, blk))
+			continue;
+		entries[i].pos = blk * erasesize;
+		entries[i].hash = mbox_hash(context->lpc_mem + entries[i].pos,
+				erasesize);
+		rc = journal_pwrite(context->journal_fd,
+				context->lpc_mem + entries[i].pos, erasesize,
+				data + (off_t)i * erasesize);
+		i++;
+	}
+	hdr.hash = mbox_hash(entries, hdr.count * sizeof(*entries));
+
+	if (!rc)
+		rc = journal_pwrite(context->journal_fd, entries,
+				hdr.count * sizeof(*entries), sizeof(hdr));
+	if (!rc)
+		rc = journal_pwrite(context->journal_fd, &hdr, sizeof(hdr), 0);
+	if (!rc && fdatasync(context->journal_fd) < 0)
+		rc = -errno;
+
+	hdr.state = JOURNAL_COMMITTED;
+	if (!rc)
+		rc = journal_pwrite(context->journal_fd, &hdr, sizeof(hdr), 0);
+	if (!rc && fdatasync(context->journal_fd) < 0)
+		rc = -errno;
+
+	free(entries);
+	if (rc)
+		MSG_ERR("Couldn't write journal: %s\n", strerror(-rc));
+
+	return rc;
+}
+
+static void journal_done(struct mbox_context *context, struct mbox_work *work,
+		void *priv)
+{
+	context->journal_busy = false;
+	if (work->rc) {
+		MSG_ERR("Commit failed, keeping the journal to replay\n");
+		return;
+	}
+
+	journal_clear(context);
+}
+
+/* Write back everything staged as one flush, journaled first if asked */
+int txn_commit(struct mbox_context *context, uint8_t seq, uint64_t arrived)
+{
+	uint32_t erasesize = context->flash->mtd_info.erasesize;
+	struct mbox_range *ranges;
+	struct mbox_work *work;
+	uint32_t blk, first;
+	uint8_t *snap;
+	int i, n = 0;
+
+	if (!context->txn_blocks)
+		return MBOX_R_SUCCESS;
+
+	/* One commit in the journal at a time */
+	if (context->journal_busy && sched_drain(context, MBOX_SCHED_FLUSH))
+		return MBOX_R_WRITE_ERROR;
+
+	ranges = calloc(context->txn_blocks, sizeof(*ranges));
+	if (!ranges)
+		return MBOX_R_SYSTEM_ERROR;
+
+	/* Runs of staged blocks */
+	for (blk = 0; blk < txn_nblocks(context); blk++) {
+		if (!txn_test(context, blk))
+			continue;
+		if (n && ranges[n - 1].pos + ranges[n - 1].len == blk * erasesize) {
+			ranges[n - 1].len += erasesize;
+			continue;
+		}
+		ranges[n].pos = blk * erasesize;
+		ranges[n++].len = erasesize;
+	}
+
+	/*
+	 * The host can write the window again as soon as it has its answer,
+	 * the flush mustn't pick that up. Program from a copy.
+	 */
+	first = ranges[0].pos;
+	snap = malloc(ranges[n - 1].pos + ranges[n - 1].len - first);
+	if (!snap) {
+		free(ranges);
+		return MBOX_R_SYSTEM_ERROR;
+	}
+	for (i = 0; i < n; i++) {
+		ecc_check(context, ranges[i].pos, ranges[i].len);
+		memcpy(snap + ranges[i].pos - first,
+				context->lpc_mem + ranges[i].pos, ranges[i].len);
+	}
+
+	if (context->journal_fd >= 0 && journal_write(context)) {
+		free(snap);
+		free(ranges);
+		return MBOX_R_SYSTEM_ERROR;
+	}
+
+	MSG_OUT("Committing %u erase blocks in %d runs\n", context->txn_blocks,
+			n);
+	work = sched_submit_ranges(context, MBOX_SCHED_FLUSH, seq, arrived,
+			ranges, n);
+	free(ranges);
+	if (!work) {
+		free(snap);
+		return MBOX_R_SYSTEM_ERROR;
+	}
+	work->buf = snap;
+
+	if (context->journal_fd >= 0) {
+		sched_on_complete(work, journal_done, NULL);
+		context->journal_busy = true;
+	}
+
+	memset(context->txn_map, 0, (txn_nblocks(context) + 7) / 8);
+	context->txn_blocks = 0;
+	context->txn_commits++;
+
+	return sched_wait(context, work, context->caps & MBOX_CAP_ASYNC);
+}
+
+/*
+ * Whatever was staged never happened, the window gets the flash's content
+ * back. Failing that the next window command refills the lot.
+ */
+void txn_abort(struct mbox_context *context)
+{
+	uint32_t erasesize = context->flash->mtd_info.erasesize;
+	uint32_t blk;
+
+	if (!context->txn_blocks)
+		return;
+
+	MSG_OUT("Dropping %u uncommitted erase blocks\n", context->txn_blocks);
+	for (blk = 0; blk < txn_nblocks(context); blk++) {
+		if (!txn_test(context, blk))
+			continue;
+		context->txn_map[blk / 8] &= ~(1 << (blk % 8));
+		if (flash_read(context, blk * erasesize, erasesize))
+			context->fill_failed = true;
+	}
+	context->txn_blocks = 0;
+}
+
+/* Finish a commit the last run of the daemon didn't get to */
+int txn_replay(struct mbox_context *context)
+{
+	uint32_t erasesize = context->flash->mtd_info.erasesize;
+	struct journal_entry *entries = NULL;
+	struct journal_hdr hdr;
+	uint8_t *buf = NULL;
+	off_t data;
+	uint32_t i;
+	int rc;
+
+	if (context->journal_fd < 0)
+		return 0;
+
+	rc = journal_pread(context->journal_fd, &hdr, sizeof(hdr), 0);
+	if (rc == -ENODATA)
+		return 0;
+	if (rc)
+		goto out;
+
+	if (memcmp(hdr.magic, JOURNAL_MAGIC, sizeof(hdr.magic)) ||
+			hdr.erasesize != erasesize ||
+			hdr.count > txn_nblocks(context)) {
+		MSG_ERR("Journal %s isn't one of ours, ignoring it\n",
+				context->journal_path);
+		goto out;
+	}
+	if (hdr.state != JOURNAL_COMMITTED) {
+		MSG_OUT("Journal holds an unfinished transaction, the flash wasn't touched\n");
+		goto out;
+	}
+
+	entries = calloc(hdr.count, sizeof(*entries));
+	buf = malloc(erasesize);
+	if (!entries || !buf) {
+		rc = -ENOMEM;
+		goto out;
+	}
+	rc = journal_pread(context->journal_fd, entries,
+			hdr.count * sizeof(*entries), sizeof(hdr));
+	if (rc)
+		goto out;
+	if (mbox_hash(entries, hdr.count * sizeof(*entries)) != hdr.hash) {
+		MSG_ERR("Journal entries are corrupt, not replaying\n");
+		rc = -EIO;
+		goto out;
+	}
+
+	MSG_OUT("Replaying %u erase blocks from %s\n", hdr.count,
+			context->journal_path);
+	data = sizeof(hdr) + hdr.count * sizeof(*entries);
+	for (i = 0; i < hdr.count; i++) {
+		rc = journal_pread(context->journal_fd, buf, erasesize,
+				data + (off_t)i * erasesize);
+		if (rc)
+			goto out;
+		if (entries[i].pos % erasesize ||
+				entries[i].pos >= context->flash->mtd_info.size ||
+				mbox_hash(buf, erasesize) != entries[i].hash) {
+			MSG_ERR("Journal block %u is corrupt, not replaying\n", i);
+			rc = -EIO;
+			goto out;
+		}
+		/* Where the flush that journalled it would have put it */
+		if (flash_overlaid(context->flash, entries[i].pos)) {
+			rc = flash_overlay_write_buf(context, buf,
+					entries[i].pos, erasesize);
+		} else {
+			rc = flash_erase(context, entries[i].pos, erasesize);
+			if (!rc)
+				rc = flash_program_buf(context, buf,
+						entries[i].pos, erasesize);
+		}
+		if (rc)
+			goto out;
+	}
+
+out:
+	free(entries);
+	free(buf);
+	if (rc) {
+		MSG_ERR("Couldn't replay journal %s: %s\n",
+				context->journal_path, strerror(-rc));
+		return rc;
+	}
+
+	return journal_clear(context);
+}
+
+void txn_free(struct mbox_context *context)
+{
+	free(context->txn_map);
+	context->txn_map = NULL;
+	context->txn_blocks = 0;
+	if (context->journal_fd >= 0)
+		close(context->journal_fd);
+	context->journal_fd = -1;
+	free(context->journal_path);
+	context->journal_path = NULL;
+}
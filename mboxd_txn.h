@@ -0,0 +1,47 @@
+/* Copyright 2016 IBM
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *    http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *	Unless required by applicable law or agreed to in writing, software
+ *	distributed under the License is distributed on an "AS IS" BASIS,
+ *	WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *	See the License for the specific language governing permissions and
+ *	limitations under the License.
+ *
+ */
+
+#ifndef MBOXD_TXN_H
+#define MBOXD_TXN_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "mboxd.h"
+
+/*
+ * Transactional write-back. WRITE_DIRTY only stages the erase blocks it
+ * names, they stay in the window (and aren't refilled over) until
+ * WRITE_FENCE commits the lot as one flush. With a journal the new content
+ * of every block is written and synced there first, so that a commit cut
+ * short by the BMC going down is finished at the next start.
+ */
+
+int txn_init(struct mbox_context *context);
+
+void txn_stage(struct mbox_context *context, uint32_t pos, uint32_t len);
+
+bool txn_staged(struct mbox_context *context, uint32_t pos, uint32_t len);
+
+int txn_commit(struct mbox_context *context, uint8_t seq, uint64_t arrived);
+
+void txn_abort(struct mbox_context *context);
+
+int txn_replay(struct mbox_context *context);
+
+void txn_free(struct mbox_context *context);
+
+#endif /* MBOXD_TXN_H */
@@ -0,0 +1,276 @@
+/* Copyright 2016 IBM
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *    http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *	Unless required by applicable law or agreed to in writing, software
+ *	distributed under the License is distributed on an "AS IS" BASIS,
+ *	WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *	See the License for the specific language governing permissions and
+ *	limitations under the License.
+ *
+ */
+
+#define _GNU_SOURCE
+#include <errno.h>
+#include <fcntl.h>
+#include <inttypes.h>
+#include <stdarg.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <syslog.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#include "mbox.h"
+#include "common.h"
+#include "mboxd.h"
+#include "mboxd_wear.h"
+
+/* Wear file layout: the header, then a struct mbox_wear per erase block */
+#define WEAR_MAGIC "MBOXWEAR"
+
+struct wear_hdr {
+	char magic[8];
+	uint32_t erasesize;
+	uint32_t blocks;
+} __attribute__((packed));
+
+/* Where to persist the telemetry of every flash opened, NULL for nowhere */
+static const char *wear_path;
+
+int wear_policy(const char *path)
+{
+	wear_path = path;
+
+	return 0;
+}
+
+static uint32_t wear_nblocks(struct mbox_flash *flash)
+{
+	return flash->mtd_info.size / flash->mtd_info.erasesize;
+}
+
+static void wear_load(struct mbox_flash *flash)
+{
+	uint32_t blocks = wear_nblocks(flash);
+	size_t size = blocks * sizeof(*flash->wear);
+	struct wear_hdr hdr;
+	int fd;
+
+	fd = open(flash->wear_path, O_RDONLY | O_CLOEXEC);
+	if (fd < 0) {
+		if (errno != ENOENT)
+			MSG_ERR("Couldn't open wear telemetry %s: %s\n",
+					flash->wear_path, strerror(errno));
+		return;
+	}
+
+	if (read(fd, &hdr, sizeof(hdr)) != sizeof(hdr) ||
+			memcmp(hdr.magic, WEAR_MAGIC, sizeof(hdr.magic)) ||
+			hdr.erasesize != flash->mtd_info.erasesize ||
+			hdr.blocks != blocks ||
+			read(fd, flash->wear, size) != (ssize_t)size) {
+		MSG_ERR("Wear telemetry %s isn't for this flash, starting afresh\n",
+				flash->wear_path);
+		memset(flash->wear, 0, size);
+	} else {
+		MSG_OUT("Loaded wear telemetry %s\n", flash->wear_path);
+	}
+	close(fd);
+}
+
+/* Start counting for a newly opened flash */
+int wear_init(struct mbox_flash *flash)
+{
+	const char *mtd;
+
+	flash->wear = calloc(wear_nblocks(flash), sizeof(*flash->wear));
+	if (!flash->wear)
+		return -ENOMEM;
+
+	if (!wear_path)
+		return 0;
+
+	mtd = strrchr(flash->path, '/');
+	if (asprintf(&flash->wear_path, "%s.%s", wear_path,
+				mtd ? mtd + 1 : flash->path) < 0) {
+		flash->wear_path = NULL;
+		return -ENOMEM;
+	}
+	wear_load(flash);
+	flash->wear_saved = mbox_clock_ns();
+
+	return 0;
+}
+
+/* [pos, pos + len), whole erase blocks, took 'ns' to erase */
+void wear_erase(struct mbox_flash *flash, uint32_t pos, uint32_t len,
+		uint64_t ns)
+{
+	uint32_t erasesize = flash->mtd_info.erasesize;
+	uint32_t us = ns / 1000 / (len / erasesize);
+	uint32_t off;
+
+	if (!flash->wear)
+		return;
+
+	for (off = pos; off < pos + len; off += erasesize) {
+		struct mbox_wear *w = &flash->wear[off / erasesize];
+
+		w->erases++;
+		if (w->erases <= WEAR_BASELINE) {
+			w->erase_base_us += ((int64_t)us - w->erase_base_us) /
+				(int64_t)w->erases;
+			w->erase_us = w->erase_base_us;
+			continue;
+		}
+
+		w->erase_us = (w->erase_us * 7ULL + us) / 8;
+		/* An image's erase time is the page cache's, not a part's */
+		if (flash->image || w->alerted ||
+				w->erase_us <= w->erase_base_us * WEAR_DRIFT)
+			continue;
+		MSG_ERR("Erase block 0x%08x of %s now takes %uus to erase, was %uus, after %u erases\n",
+				off, flash->path, w->erase_us,
+				w->erase_base_us, w->erases);
+		w->alerted = 1;
+	}
+	flash->wear_dirty = true;
+}
+
+/* [pos, pos + len) took 'ns' to program */
+void wear_program(struct mbox_flash *flash, uint32_t pos, uint32_t len,
+		uint64_t ns)
+{
+	uint32_t erasesize = flash->mtd_info.erasesize;
+	/* Scaled to a whole erase block, to compare like with like */
+	uint32_t us = ns / 1000 * erasesize / len;
+	uint32_t off;
+
+	if (!flash->wear || !len)
+		return;
+
+	for (off = pos & ~(erasesize - 1); off < pos + len;
+			off += erasesize) {
+		struct mbox_wear *w = &flash->wear[off / erasesize];
+
+		w->program_us = w->programs++ ?
+			(w->program_us * 7ULL + us) / 8 : us;
+	}
+	flash->wear_dirty = true;
+}
+
+/*
+ * Replace the wear file as a whole, so a crash leaves the old one. Unless
+ * 'force', not within WEAR_SAVE_INTERVAL_NS of the last time.
+ */
+int wear_save(struct mbox_flash *flash, bool force)
+{
+	uint32_t blocks = wear_nblocks(flash);
+	struct wear_hdr hdr = {
+		.magic = WEAR_MAGIC,
+		.erasesize = flash->mtd_info.erasesize,
+		.blocks = blocks,
+	};
+	size_t size = blocks * sizeof(*flash->wear);
+	uint64_t now = mbox_clock_ns();
+	char *tmp;
+	int fd, rc = 0;
+
+	if (!flash->wear_path || !flash->wear_dirty)
+		return 0;
+	if (!force && now - flash->wear_saved < WEAR_SAVE_INTERVAL_NS)
+		return 0;
+
+	if (asprintf(&tmp, "%s.tmp", flash->wear_path) < 0)
+		return -ENOMEM;
+
+	fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC,
+			S_IRUSR | S_IWUSR);
+	if (fd < 0 ||
+			write(fd, &hdr, sizeof(hdr)) != sizeof(hdr) ||
+			write(fd, flash->wear, size) != (ssize_t)size ||
+			fsync(fd) < 0 || rename(tmp, flash->wear_path) < 0) {
+		rc = -errno;
+		MSG_ERR("Couldn't save wear telemetry %s: %s\n",
+				flash->wear_path, strerror(errno));
+		unlink(tmp);
+	} else {
+		flash->wear_dirty = false;
+		flash->wear_saved = now;
+	}
+	if (fd >= 0)
+		close(fd);
+	free(tmp);
+
+	return rc;
+}
+
+/* Totals, then the WEAR_HOT most erased blocks, as text */
+int wear_report(struct mbox_flash *flash, char *buf, size_t size)
+{
+	uint32_t blocks = wear_nblocks(flash);
+	uint32_t hot[WEAR_HOT];
+	unsigned long long erases = 0, programs = 0;
+	uint32_t blk, slowest = 0, drifting = 0;
+	size_t len = 0;
+	int i, j, n = 0;
+
+	if (!flash->wear)
+		return 0;
+
+	for (blk = 0; blk < blocks; blk++) {
+		struct mbox_wear *w = &flash->wear[blk];
+
+		erases += w->erases;
+		programs += w->programs;
+		drifting += w->alerted;
+		if (w->erase_us > slowest)
+			slowest = w->erase_us;
+		if (!w->erases)
+			continue;
+
+		/* Keep hot[] sorted, most erased first */
+		for (i = n; i > 0; i--) {
+			if (flash->wear[hot[i - 1]].erases >= w->erases)
+				break;
+		}
+		if (i == WEAR_HOT)
+			continue;
+		if (n < WEAR_HOT)
+			n++;
+		for (j = n - 1; j > i; j--)
+			hot[j] = hot[j - 1];
+		hot[i] = blk;
+	}
+
+	len += snprintf(buf + len, size - len,
+			"%s: %llu erases, %llu programs, slowest erase %uus, %u erase blocks slowing down\n",
+			flash->path, erases, programs, slowest, drifting);
+	for (i = 0; i < n && len < size; i++) {
+		struct mbox_wear *w = &flash->wear[hot[i]];
+
+		len += snprintf(buf + len, size - len,
+				"%s: erase block 0x%08x, %u erases, %u programs, erase %uus (was %uus), program %uus%s\n",
+				flash->path,
+				hot[i] * flash->mtd_info.erasesize,
+				w->erases, w->programs, w->erase_us,
+				w->erase_base_us, w->program_us,
+				w->alerted ? ", slowing down" : "");
+	}
+
+	return len;
+}
+
+void wear_free(struct mbox_flash *flash)
+{
+	wear_save(flash, true);
+	free(flash->wear);
+	free(flash->wear_path);
+}
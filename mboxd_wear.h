@@ -0,0 +1,70 @@
+/* Copyright 2016 IBM
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *    http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *	Unless required by applicable law or agreed to in writing, software
+ *	distributed under the License is distributed on an "AS IS" BASIS,
+ *	WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *	See the License for the specific language governing permissions and
+ *	limitations under the License.
+ *
+ */
+
+#ifndef MBOXD_WEAR_H
+#define MBOXD_WEAR_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "mboxd.h"
+
+/*
+ * Wear telemetry. Erases and programs of every erase block are counted
+ * and timed as they reach the chip, and optionally persisted across
+ * restarts (--wear). A block of a MTD whose erases take much longer than
+ * they did when first seen is reported once, as a sign the part is wearing
+ * out.
+ */
+
+/* Erases averaged for a block's baseline erase time */
+#define WEAR_BASELINE 8
+/* Report a block once its erases take this many times the baseline */
+#define WEAR_DRIFT 2
+/* Blocks in the hot block report */
+#define WEAR_HOT 8
+/* Save no more often than this while writes keep coming */
+#define WEAR_SAVE_INTERVAL_NS (60 * 1000000000ULL)
+
+/* Kept on disk as is, so fixed size */
+struct mbox_wear {
+	uint32_t erases;
+	uint32_t programs;
+	/* Microseconds per erase block: baseline, then moving averages */
+	uint32_t erase_base_us;
+	uint32_t erase_us;
+	uint32_t program_us;
+	/* The erase time drift was reported */
+	uint32_t alerted;
+} __attribute__((packed));
+
+int wear_policy(const char *path);
+
+int wear_init(struct mbox_flash *flash);
+
+void wear_erase(struct mbox_flash *flash, uint32_t pos, uint32_t len,
+		uint64_t ns);
+
+void wear_program(struct mbox_flash *flash, uint32_t pos, uint32_t len,
+		uint64_t ns);
+
+int wear_save(struct mbox_flash *flash, bool force);
+
+int wear_report(struct mbox_flash *flash, char *buf, size_t size);
+
+void wear_free(struct mbox_flash *flash);
+
+#endif /* MBOXD_WEAR_H */